@@ -0,0 +1,135 @@
+#include "buffer_pool.h"
+
+using namespace std;
+
+// Buffers start on a 16 byte boundary after their header
+static const size_t kBufferAlign = 16;
+
+static size_t bufferStride(const BufferPool &pool) {
+    return (sizeof(PoolBuffer) + pool.bufferSize + kBufferAlign - 1) / kBufferAlign * kBufferAlign;
+}
+
+static size_t slabHeader() {
+    return (sizeof(PoolSlab) + kBufferAlign - 1) / kBufferAlign * kBufferAlign;
+}
+
+static size_t slabBytes(const BufferPool &pool) {
+    return slabHeader() + kBuffersPerSlab * bufferStride(pool);
+}
+
+static void unlinkSlab(PoolSlab *slab) {
+    slab->prev->next = slab->next;
+    slab->next->prev = slab->prev;
+}
+
+static void linkSlabAfter(PoolSlab *position, PoolSlab *slab) {
+    slab->prev = position;
+    slab->next = position->next;
+    position->next->prev = slab;
+    position->next = slab;
+}
+
+// ***********************************************************
+// ** Copies the pool's gauges to its worker's stats.
+// ***********************************************************
+static void publishPool(BufferPool &pool) {
+    pool.stats->poolBuffersInUse.store(pool.inUse, memory_order_relaxed);
+    pool.stats->poolHighWater.store(pool.highWater, memory_order_relaxed);
+    pool.stats->poolBytes.store(pool.slabCount * slabBytes(pool), memory_order_relaxed);
+}
+
+void initBufferPool(BufferPool &pool, size_t bufferSize, size_t spareSlabs, WorkerStats *stats) {
+    pool.bufferSize = bufferSize;
+    pool.spareSlabs = spareSlabs;
+    pool.partial.prev = &pool.partial;
+    pool.partial.next = &pool.partial;
+    pool.slabCount = 0;
+    pool.emptySlabs = 0;
+    pool.inUse = 0;
+    pool.highWater = 0;
+    pool.stats = stats;
+}
+
+// **************************************************************************************
+// * releaseBufferPool()
+// * - Frees every slab. Only called once nothing borrowed from the pool is in use.
+// **************************************************************************************
+void releaseBufferPool(BufferPool &pool) {
+    while (pool.partial.next != &pool.partial) {
+        PoolSlab *slab = pool.partial.next;
+        unlinkSlab(slab);
+        delete[] (char *)slab;
+    }
+    pool.slabCount = 0;
+    pool.emptySlabs = 0;
+}
+
+// **************************************************************************************
+// * borrowBuffer()
+// * - Hands out one bufferSize buffer, carving a new slab when every slab is full.
+// **************************************************************************************
+PoolBuffer *borrowBuffer(BufferPool &pool) {
+    if (pool.partial.next == &pool.partial) {
+        char *memory = new char[slabBytes(pool)];
+        PoolSlab *slab = (PoolSlab *)memory;
+        slab->freeList = NULL;
+        slab->freeCount = kBuffersPerSlab;
+        for (unsigned i = 0; i < kBuffersPerSlab; i++) {
+            PoolBuffer *buffer = (PoolBuffer *)(memory + slabHeader() + i * bufferStride(pool));
+            buffer->slab = slab;
+            buffer->next = slab->freeList;
+            slab->freeList = buffer;
+        }
+        linkSlabAfter(&pool.partial, slab);
+        pool.slabCount++;
+        pool.emptySlabs++;
+    }
+
+    PoolSlab *slab = pool.partial.next;
+    if (slab->freeCount == kBuffersPerSlab) {
+        pool.emptySlabs--;
+    }
+    PoolBuffer *buffer = slab->freeList;
+    slab->freeList = buffer->next;
+    buffer->next = NULL;
+    slab->freeCount--;
+    if (slab->freeCount == 0) {
+        unlinkSlab(slab);
+    }
+
+    pool.inUse++;
+    if (pool.inUse > pool.highWater) {
+        pool.highWater = pool.inUse;
+    }
+    publishPool(pool);
+    return buffer;
+}
+
+// **************************************************************************************
+// * returnBuffer()
+// * - Puts a buffer back in its slab. A slab that was full goes to the front of the
+// *   partial list; one that is now empty goes to the back, or back to the heap if
+// *   there are already enough spare slabs.
+// **************************************************************************************
+void returnBuffer(BufferPool &pool, PoolBuffer *buffer) {
+    PoolSlab *slab = buffer->slab;
+    buffer->next = slab->freeList;
+    slab->freeList = buffer;
+    slab->freeCount++;
+    pool.inUse--;
+
+    if (slab->freeCount == 1) {
+        linkSlabAfter(&pool.partial, slab);
+    }
+    if (slab->freeCount == kBuffersPerSlab) {
+        unlinkSlab(slab);
+        if (pool.emptySlabs < pool.spareSlabs) {
+            linkSlabAfter(pool.partial.prev, slab);
+            pool.emptySlabs++;
+        } else {
+            delete[] (char *)slab;
+            pool.slabCount--;
+        }
+    }
+    publishPool(pool);
+}
@@ -0,0 +1,59 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include "stats.h"
+
+// ********************************************************
+// * Slab allocator for output buffers, one per worker so
+// * it needs no locks.
+// *
+// * Memory comes in slabs of kBuffersPerSlab equal-sized
+// * buffers. A slab with a free buffer sits on the pool's
+// * partial list; the most used slabs are at the front and
+// * are handed out from first, so traffic packs into as
+// * few slabs as possible and the rest drain completely.
+// * Up to spareSlabs completely free slabs are kept for the
+// * next burst and any more are given back.
+// ********************************************************
+static const unsigned kBuffersPerSlab = 16;
+
+struct PoolSlab;
+
+// Header in front of every buffer. next links free buffers
+// within a slab, and the buffers of one OutputBuffer in order.
+struct PoolBuffer {
+    PoolSlab *slab;
+    PoolBuffer *next;
+};
+
+struct PoolSlab {
+    PoolSlab *prev;
+    PoolSlab *next;
+    PoolBuffer *freeList;
+    unsigned freeCount;
+};
+
+struct BufferPool {
+    size_t bufferSize;
+    size_t spareSlabs;
+    // Slabs with at least one free buffer
+    PoolSlab partial;
+    size_t slabCount;
+    size_t emptySlabs;
+    size_t inUse;
+    size_t highWater;
+    // Where the pool's gauges are published for STATS
+    WorkerStats *stats;
+};
+
+inline char *bufferData(PoolBuffer *buffer) {
+    return (char *)(buffer + 1);
+}
+
+void initBufferPool(BufferPool &pool, size_t bufferSize, size_t spareSlabs, WorkerStats *stats);
+void releaseBufferPool(BufferPool &pool);
+PoolBuffer *borrowBuffer(BufferPool &pool);
+void returnBuffer(BufferPool &pool, PoolBuffer *buffer);
+
+#endif
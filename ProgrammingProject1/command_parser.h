@@ -0,0 +1,310 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// ********************************************************
+// * Commands a client can send in place of data to echo.
+// ********************************************************
+enum Command {
+    CMD_NONE,
+    CMD_CLOSE,
+    CMD_QUIT,
+    CMD_STATS,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_PUBLISH
+};
+
+// ***********************************************************
+// ** Publish/subscribe is only served by the epoll loops. The
+// ** blocking and io_uring loops answer these commands with
+// ** kNoPubSubReply, so the client isn't left waiting for a
+// ** delivery that will never come.
+// ***********************************************************
+static const char kNoPubSubReply[] = "ERROR publish/subscribe needs -m epoll or busy\n";
+
+inline bool isPubSubCommand(Command command) {
+    return command == CMD_SUBSCRIBE || command == CMD_UNSUBSCRIBE || command == CMD_PUBLISH;
+}
+
+// ********************************************************
+// * Incremental, line-framed command parser.
+// *
+// * A command is a line holding nothing but the command
+// * word, optionally followed by '\r'. Every other byte is
+// * data to echo. The parser keeps its state across reads,
+// * so a command split over two reads is still found, and
+// * holds back the start of a line while it could still
+// * turn out to be a command. Nothing is allocated except
+// * for an argument that spans reads.
+// *
+// * SUBSCRIBE, UNSUBSCRIBE and PUBLISH take an argument:
+// * once the word and one space have matched, the rest of
+// * the line is the argument, up to kMaxArgument bytes. A
+// * longer line is echoed as data after all.
+// ********************************************************
+static const size_t kMaxHeld = 16;
+static const size_t kMaxArgument = 65536;
+
+struct CommandParser {
+    // Start of the current line from earlier reads, held
+    // back while it is still a possible command
+    char held[kMaxHeld];
+    size_t heldLength;
+    // Bit i is set while the line can still be kCommandWords[i]
+    unsigned candidates;
+    // The current line is already known to be data
+    bool inData;
+    // The current line is argumentCommand's word and space, and
+    // argument holds what has been read of the rest of it
+    // before this input
+    bool inArgument;
+    Command argumentCommand;
+    std::string argument;
+    // Argument of the command parseInput() last returned,
+    // without its line ending. Only valid until the next call.
+    const char *argumentData;
+    size_t argumentLength;
+};
+
+struct CommandWord {
+    const char *word;
+    size_t length;
+    Command command;
+    bool takesArgument;
+};
+
+static const CommandWord kCommandWords[] = {
+    { "CLOSE", 5, CMD_CLOSE, false },
+    { "QUIT", 4, CMD_QUIT, false },
+    { "STATS", 5, CMD_STATS, false },
+    { "SUBSCRIBE", 9, CMD_SUBSCRIBE, true },
+    { "UNSUBSCRIBE", 11, CMD_UNSUBSCRIBE, true },
+    { "PUBLISH", 7, CMD_PUBLISH, true },
+};
+static const size_t kCommandWordCount = sizeof(kCommandWords) / sizeof(kCommandWords[0]);
+static const unsigned kAllCandidates = (1U << kCommandWordCount) - 1;
+
+// ***********************************************************
+// ** True while the client has sent part of a line but not
+// ** its end.
+// ***********************************************************
+inline bool midLine(const CommandParser &parser) {
+    return parser.heldLength > 0 || parser.inData || parser.inArgument;
+}
+
+// ***********************************************************
+// ** Starts a new line. The argument of the last command is
+// ** left alone, since the caller may not have used it yet.
+// ***********************************************************
+inline void initParser(CommandParser &parser) {
+    parser.heldLength = 0;
+    parser.candidates = kAllCandidates;
+    parser.inData = false;
+    parser.inArgument = false;
+}
+
+// ***********************************************************
+// ** Narrows the candidate set with the byte at position
+// ** `position` of the line. A word stays a candidate while
+// ** the line matches it, and for one more byte if that byte
+// ** is the '\r' of a "\r\n" line ending, or the space
+// ** before its argument.
+// ***********************************************************
+inline unsigned matchByte(unsigned candidates, size_t position, char byte) {
+    unsigned remaining = 0;
+    for (size_t i = 0; i < kCommandWordCount; i++) {
+        if (!(candidates & (1U << i))) {
+            continue;
+        }
+        const CommandWord &word = kCommandWords[i];
+        char after = word.takesArgument ? ' ' : '\r';
+        if (position < word.length ? word.word[position] == byte
+                                   : position == word.length && byte == after) {
+            remaining |= 1U << i;
+        }
+    }
+    return remaining;
+}
+
+// ***********************************************************
+// ** The command a finished line of `length` bytes is, if any.
+// ***********************************************************
+inline Command completedCommand(unsigned candidates, size_t length) {
+    for (size_t i = 0; i < kCommandWordCount; i++) {
+        const CommandWord &word = kCommandWords[i];
+        if ((candidates & (1U << i)) && !word.takesArgument &&
+            (length == word.length || length == word.length + 1)) {
+            return word.command;
+        }
+    }
+    return CMD_NONE;
+}
+
+// ***********************************************************
+// ** The command whose word and space make up the first
+// ** `length` bytes of the line, if any.
+// ***********************************************************
+inline Command argumentCommand(unsigned candidates, size_t length) {
+    for (size_t i = 0; i < kCommandWordCount; i++) {
+        const CommandWord &word = kCommandWords[i];
+        if ((candidates & (1U << i)) && word.takesArgument && length == word.length + 1) {
+            return word.command;
+        }
+    }
+    return CMD_NONE;
+}
+
+// ***********************************************************
+// ** Points argumentData at a finished argument: straight at
+// ** the input if it all came in this read, otherwise at the
+// ** copy built up across reads.
+// ***********************************************************
+inline void finishArgument(CommandParser &parser, const char *bytes, size_t length) {
+    if (parser.argument.empty()) {
+        parser.argumentData = bytes;
+        parser.argumentLength = length;
+    } else {
+        parser.argument.append(bytes, length);
+        parser.argumentData = parser.argument.data();
+        parser.argumentLength = parser.argument.size();
+    }
+    if (parser.argumentLength > 0 && parser.argumentData[parser.argumentLength - 1] == '\r') {
+        parser.argumentLength--;
+    }
+}
+
+// **************************************************************************************
+// * parseInput()
+// * - Feeds the next bytes from the client to the parser. Every run of bytes that should
+// *   be echoed is passed to echo(const char *data, size_t length), in order.
+// * - Stops after the first complete command line and returns it in command, with its
+// *   argument in argumentData. The return value is the number of input bytes used;
+// *   bytes after a command are left for the caller to decide about.
+// * - Lines that are data are skipped over with memchr(), which the C library
+// *   vectorizes, so only the first few bytes of each line are looked at one at a time.
+// **************************************************************************************
+template <typename Echo>
+size_t parseInput(CommandParser &parser, const char *data, size_t length, Command &command, Echo echo) {
+    command = CMD_NONE;
+    if (!parser.inArgument && !parser.argument.empty()) {
+        std::string().swap(parser.argument);
+    }
+    size_t position = 0;
+    // Where the current line started in this input when it started here
+    size_t lineStart = 0;
+    // Where the current line's argument starts in this input
+    size_t argumentStart = 0;
+
+    while (position < length) {
+        if (parser.inArgument) {
+            const char *newline = (const char *)memchr(data + position, '\n', length - position);
+            size_t end = newline == NULL ? length : newline - data;
+            if (parser.argument.size() + (end - argumentStart) > kMaxArgument) {
+                // Too long to be a command, so the line is data. Bytes from earlier reads
+                // go out first, as for any other line.
+                if (parser.heldLength > 0) {
+                    echo(parser.held, parser.heldLength);
+                    parser.heldLength = 0;
+                }
+                if (!parser.argument.empty()) {
+                    echo(parser.argument.data(), parser.argument.size());
+                    std::string().swap(parser.argument);
+                }
+                parser.inArgument = false;
+                parser.inData = true;
+                continue;
+            }
+            if (newline == NULL) {
+                position = length;
+                break;
+            }
+
+            if (lineStart > 0) {
+                echo(data, lineStart);
+            }
+            finishArgument(parser, data + argumentStart, end - argumentStart);
+            command = parser.argumentCommand;
+            initParser(parser);
+            return end + 1;
+        }
+
+        if (parser.inData) {
+            const char *newline = (const char *)memchr(data + position, '\n', length - position);
+            if (newline == NULL) {
+                position = length;
+                break;
+            }
+            position = newline - data + 1;
+            parser.inData = false;
+            parser.candidates = kAllCandidates;
+            lineStart = position;
+            continue;
+        }
+
+        // Still at the start of a line that could be a command
+        size_t lineLength = parser.heldLength + (position - lineStart);
+        char byte = data[position];
+
+        if (byte == '\n') {
+            Command found = completedCommand(parser.candidates, lineLength);
+            if (found != CMD_NONE) {
+                // Everything before the command line is echoed, the line itself isn't
+                if (lineStart > 0) {
+                    echo(data, lineStart);
+                }
+                initParser(parser);
+                command = found;
+                return position + 1;
+            }
+        } else {
+            parser.candidates = matchByte(parser.candidates, lineLength, byte);
+            if (parser.candidates != 0) {
+                position++;
+                Command found = argumentCommand(parser.candidates, lineLength + 1);
+                if (found != CMD_NONE) {
+                    parser.inArgument = true;
+                    parser.argumentCommand = found;
+                    argumentStart = position;
+                }
+                continue;
+            }
+        }
+
+        // The line turned out to be data. Bytes held from an earlier read go out first;
+        // nothing from this input can be ahead of them since the line started before it.
+        if (parser.heldLength > 0) {
+            echo(parser.held, parser.heldLength);
+            parser.heldLength = 0;
+        }
+        if (byte == '\n') {
+            position++;
+            parser.candidates = kAllCandidates;
+            lineStart = position;
+        } else {
+            parser.inData = true;
+        }
+    }
+
+    // A possible command at the end of the input is held back until the next read
+    size_t echoEnd = length;
+    if (parser.inArgument) {
+        echoEnd = lineStart;
+        memcpy(parser.held + parser.heldLength, data + lineStart, argumentStart - lineStart);
+        parser.heldLength += argumentStart - lineStart;
+        parser.argument.append(data + argumentStart, length - argumentStart);
+    } else if (!parser.inData) {
+        echoEnd = lineStart;
+        memcpy(parser.held + parser.heldLength, data + lineStart, length - lineStart);
+        parser.heldLength += length - lineStart;
+    }
+    if (echoEnd > 0) {
+        echo(data, echoEnd);
+    }
+    return length;
+}
+
+#endif
@@ -0,0 +1,449 @@
+#include "echo_s.h"
+#include "latency_histogram.h"
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+
+bool VERBOSE;
+using namespace std;
+
+// Number of events handled per epoll_wait() call
+static const int kMaxEvents = 256;
+// Size of the scratch buffer used for every read
+static const size_t kReadChunk = 65536;
+// A UDP message with no reply after this long is counted as lost
+static const uint64_t kLossTimeoutNs = 1000000000ULL;
+
+// ********************************************************
+// * Settings for one benchmark run.
+// ********************************************************
+struct BenchConfig {
+    string host;
+    u_int16_t port;
+    int connections;
+    int threads;
+    size_t messageSize;
+    int pipelineDepth;
+    double rate;
+    double duration;
+    double warmup;
+    bool sendQuit;
+    bool udp;
+    bool spin;
+    bool framed;
+};
+
+// ********************************************************
+// * One client connection. sendTimes is a small ring of
+// * the times the messages still in flight were due, so a
+// * reply can be matched with the oldest one.
+// ********************************************************
+struct BenchConnection {
+    int fd;
+    size_t sendOffset;
+    size_t receivedBytes;
+    vector<uint64_t> sendTimes;
+    size_t sendHead;
+    size_t inFlight;
+    uint64_t nextSend;
+};
+
+// ********************************************************
+// * One client thread and what it measured.
+// ********************************************************
+struct BenchThread {
+    int epollFd;
+    vector<BenchConnection> connections;
+    LatencyHistogram histogram;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t lost;
+};
+
+static BenchConfig config;
+static string message;
+
+// **************************************************************************************
+// * connectTo()
+// * - Opens one connection to the server with Nagle turned off so small messages go
+// *   out right away. In UDP mode it is a connected UDP socket, so each message is one
+// *   datagram and only the server's replies are received on it.
+// **************************************************************************************
+static int connectTo(const struct sockaddr_in &server) {
+    int fd = socket(AF_INET, config.udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)&server, sizeof(server)) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    int enable = 1;
+    if (!config.udp) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// **************************************************************************************
+// * sendMessages()
+// * - Sends as many messages as the pipeline depth and, if a rate is set, the schedule
+// *   allow. A message's latency is measured from when it was due, not when it was
+// *   finally sent, so a stalled server can't hide its stall from the numbers.
+// **************************************************************************************
+static void sendMessages(BenchThread &bench, BenchConnection &conn, uint64_t now, uint64_t interval) {
+    while (true) {
+        // Finish a partly sent message before starting another
+        if (conn.sendOffset == 0) {
+            if (conn.inFlight == (size_t)config.pipelineDepth) {
+                return;
+            }
+            if (interval > 0 && conn.nextSend > now) {
+                return;
+            }
+        }
+
+        ssize_t bytesSent = send(conn.fd, message.data() + conn.sendOffset, message.size() - conn.sendOffset,
+                                 MSG_NOSIGNAL);
+        if (bytesSent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                bench.errors++;
+            }
+            return;
+        }
+
+        // A message is only in flight once some of it has actually gone out
+        if (conn.sendOffset == 0) {
+            uint64_t due = interval > 0 ? conn.nextSend : now;
+            conn.sendTimes[(conn.sendHead + conn.inFlight) % conn.sendTimes.size()] = due;
+            conn.inFlight++;
+            conn.nextSend += interval;
+        }
+        conn.sendOffset += bytesSent;
+        if (conn.sendOffset < message.size()) {
+            return;
+        }
+        conn.sendOffset = 0;
+    }
+}
+
+// **************************************************************************************
+// * receiveReplies()
+// * - Reads what the server echoed and records a latency for every complete message.
+// **************************************************************************************
+static void receiveReplies(BenchThread &bench, BenchConnection &conn, bool measuring) {
+    char buffer[kReadChunk];
+    while (true) {
+        ssize_t bytesRead = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (bytesRead <= 0) {
+            // An empty datagram is still a datagram; only TCP uses 0 for end of stream
+            if ((bytesRead == 0 && !config.udp) ||
+                (bytesRead == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                bench.errors++;
+                epoll_ctl(bench.epollFd, EPOLL_CTL_DEL, conn.fd, NULL);
+            }
+            return;
+        }
+
+        uint64_t now = monotonicNanos();
+        conn.receivedBytes += bytesRead;
+        if (measuring) {
+            bench.bytes += bytesRead;
+        }
+        while (conn.receivedBytes >= message.size() && conn.inFlight > 0) {
+            conn.receivedBytes -= message.size();
+            uint64_t due = conn.sendTimes[conn.sendHead];
+            conn.sendHead = (conn.sendHead + 1) % conn.sendTimes.size();
+            conn.inFlight--;
+            if (measuring) {
+                recordLatency(bench.histogram, now - due);
+                bench.messages++;
+            }
+        }
+        // A late reply to a message already counted as lost is dropped here
+        if (config.udp) {
+            conn.receivedBytes = 0;
+        }
+    }
+}
+
+// **************************************************************************************
+// * expireLost()
+// * - Gives up on UDP messages that have waited too long for a reply, so a dropped
+// *   datagram doesn't hold a pipeline slot for the rest of the run.
+// **************************************************************************************
+static void expireLost(BenchThread &bench, BenchConnection &conn, uint64_t now, bool measuring) {
+    while (conn.inFlight > 0 && now > conn.sendTimes[conn.sendHead] + kLossTimeoutNs) {
+        conn.sendHead = (conn.sendHead + 1) % conn.sendTimes.size();
+        conn.inFlight--;
+        if (measuring) {
+            bench.lost++;
+        }
+    }
+}
+
+// **************************************************************************************
+// * runBenchThread()
+// * - Drives this thread's connections until the run is over. Nothing measured during
+// *   the warmup is kept.
+// **************************************************************************************
+static void runBenchThread(BenchThread *benchPtr, uint64_t start) {
+    BenchThread &bench = *benchPtr;
+    uint64_t warmupEnd = start + (uint64_t)(config.warmup * 1e9);
+    uint64_t end = warmupEnd + (uint64_t)(config.duration * 1e9);
+    uint64_t interval = config.rate > 0 ? (uint64_t)(config.connections * 1e9 / config.rate) : 0;
+
+    // Spread the first sends of a rate-limited run evenly over one interval
+    for (size_t i = 0; i < bench.connections.size(); i++) {
+        bench.connections[i].nextSend = start + interval * i / bench.connections.size();
+    }
+
+    struct epoll_event events[kMaxEvents];
+    uint64_t now = monotonicNanos();
+    while (now < end) {
+        bool measuring = now >= warmupEnd;
+        for (size_t i = 0; i < bench.connections.size(); i++) {
+            if (config.udp) {
+                expireLost(bench, bench.connections[i], now, measuring);
+            }
+            sendMessages(bench, bench.connections[i], now, interval);
+        }
+
+        // Without a rate there is always something to wait for; with one, wake up in
+        // time for the next scheduled send. A spinning client never sleeps, so its own
+        // wakeups don't show up in the latencies.
+        int timeout = interval > 0 ? 1 : 100;
+        if (config.spin) {
+            timeout = 0;
+        }
+        int eventCount = epoll_wait(bench.epollFd, events, kMaxEvents, timeout);
+        for (int i = 0; i < eventCount; i++) {
+            BenchConnection &conn = bench.connections[events[i].data.u32];
+            receiveReplies(bench, conn, measuring);
+        }
+        now = monotonicNanos();
+    }
+}
+
+// **************************************************************************************
+// * printUsage()
+// **************************************************************************************
+static void printUsage(const char *program) {
+    cout << "usage: " << program << " -p port [-v] [-h host] [-c connections] [-t threads]" << endl;
+    cout << "       [-s message size] [-d pipeline depth] [-r messages/sec, 0 = as fast as possible]" << endl;
+    cout << "       [-D duration sec] [-w warmup sec] [-q send QUIT when done] [-u use UDP]" << endl;
+    cout << "       [-y spin instead of sleeping between events] [-f send binary frames, for echo_s -f]" << endl;
+}
+
+// **************************************************************************************
+// * main()
+// * - Opens the connections, runs the load on every thread and prints one summary.
+// **************************************************************************************
+int main(int argc, char *argv[]) {
+    config.host = "127.0.0.1";
+    config.port = 0;
+    config.connections = 100;
+    config.threads = 1;
+    config.messageSize = 64;
+    config.pipelineDepth = 1;
+    config.rate = 0;
+    config.duration = 10;
+    config.warmup = 1;
+    config.sendQuit = false;
+    config.udp = false;
+    config.spin = false;
+    config.framed = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "vh:p:c:t:s:d:r:D:w:quyf")) != -1) {
+        switch (opt) {
+        case 'v':
+            VERBOSE = true;
+            break;
+        case 'h':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 's':
+            config.messageSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            config.pipelineDepth = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'D':
+            config.duration = atof(optarg);
+            break;
+        case 'w':
+            config.warmup = atof(optarg);
+            break;
+        case 'q':
+            config.sendQuit = true;
+            break;
+        case 'u':
+            config.udp = true;
+            break;
+        case 'y':
+            config.spin = true;
+            break;
+        case 'f':
+            config.framed = true;
+            break;
+        default:
+            printUsage(argv[0]);
+            exit(-1);
+        }
+    }
+    if (config.port == 0 || config.connections < 1 || config.threads < 1 || config.messageSize < 1 ||
+        config.pipelineDepth < 1 || config.duration <= 0) {
+        printUsage(argv[0]);
+        exit(-1);
+    }
+    if (config.udp && config.messageSize > 65507) {
+        cout << "a UDP message can be at most 65507 bytes" << endl;
+        exit(-1);
+    }
+    if (config.udp && config.framed) {
+        cout << "-u and -f can't be used together" << endl;
+        exit(-1);
+    }
+    if (config.threads > config.connections) {
+        config.threads = config.connections;
+    }
+
+    // Every message is one line of filler, which the server never mistakes for a command,
+    // or in framing mode one data frame with a payload of the message size
+    if (config.framed) {
+        message = makeFrame(FRAME_DATA, string(config.messageSize, 'x'));
+    } else {
+        message.assign(config.messageSize - 1, 'x');
+        message += '\n';
+    }
+
+    struct sockaddr_in server;
+    bzero(&server, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &server.sin_addr) != 1) {
+        cout << "bad host address " << config.host << endl;
+        exit(-1);
+    }
+
+    // ********************************************************************
+    // * Connections are dealt out to the threads round robin.
+    // ********************************************************************
+    vector<BenchThread> benches(config.threads);
+    for (int t = 0; t < config.threads; t++) {
+        benches[t].epollFd = epoll_create1(EPOLL_CLOEXEC);
+        resetHistogram(benches[t].histogram);
+        benches[t].messages = 0;
+        benches[t].bytes = 0;
+        benches[t].errors = 0;
+        benches[t].lost = 0;
+    }
+    for (int i = 0; i < config.connections; i++) {
+        BenchThread &bench = benches[i % config.threads];
+        BenchConnection conn;
+        conn.fd = connectTo(server);
+        if (conn.fd == -1) {
+            exit(-1);
+        }
+        conn.sendOffset = 0;
+        conn.receivedBytes = 0;
+        conn.sendTimes.assign(config.pipelineDepth, 0);
+        conn.sendHead = 0;
+        conn.inFlight = 0;
+        conn.nextSend = 0;
+
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = bench.connections.size();
+        epoll_ctl(bench.epollFd, EPOLL_CTL_ADD, conn.fd, &event);
+        bench.connections.push_back(conn);
+    }
+    DEBUG << "Opened " << config.connections << " connections on " << config.threads << " threads" << ENDL;
+
+    uint64_t start = monotonicNanos();
+    vector<thread> threads;
+    for (int t = 1; t < config.threads; t++) {
+        threads.push_back(thread(runBenchThread, &benches[t], start));
+    }
+    runBenchThread(&benches[0], start);
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+
+    // ********************************************************************
+    // * Merge what every thread measured and report it.
+    // ********************************************************************
+    LatencyHistogram histogram;
+    resetHistogram(histogram);
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    uint64_t lost = 0;
+    for (int t = 0; t < config.threads; t++) {
+        mergeHistogram(histogram, benches[t].histogram);
+        messages += benches[t].messages;
+        bytes += benches[t].bytes;
+        errors += benches[t].errors;
+        lost += benches[t].lost;
+    }
+
+    cout << fixed << setprecision(1);
+    cout << (config.udp ? "udp, " : "") << "connections " << config.connections << ", threads " << config.threads << ", size "
+         << config.messageSize << ", depth " << config.pipelineDepth << ", rate "
+         << (config.rate > 0 ? to_string((long long)config.rate) : string("max")) << ", duration "
+         << config.duration << "s" << endl;
+    cout << "messages/sec: " << messages / config.duration << endl;
+    cout << "bytes/sec:    " << bytes / config.duration << endl;
+    cout << "latency usec: p50 " << latencyPercentile(histogram, 0.50) / 1000.0
+         << "  p99 " << latencyPercentile(histogram, 0.99) / 1000.0
+         << "  p99.9 " << latencyPercentile(histogram, 0.999) / 1000.0
+         << "  max " << histogram.max / 1000.0 << endl;
+    if (errors > 0) {
+        cout << "errors:       " << errors << endl;
+    }
+    if (lost > 0) {
+        cout << "lost:         " << lost << endl;
+    }
+
+    for (int t = 0; t < config.threads; t++) {
+        for (size_t i = 0; i < benches[t].connections.size(); i++) {
+            close(benches[t].connections[i].fd);
+        }
+        close(benches[t].epollFd);
+    }
+
+    if (config.sendQuit) {
+        int fd = connectTo(server);
+        if (fd != -1) {
+            string quit = config.framed ? makeFrame(FRAME_QUIT, "") : "QUIT\n";
+            if (send(fd, quit.data(), quit.size(), 0) == -1) {
+                perror("send");
+            }
+            close(fd);
+        }
+    }
+    return errors > 0 ? 1 : 0;
+}
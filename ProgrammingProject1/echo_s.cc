@@ -4,11 +4,50 @@
 #include <cstring>
 #include <ctime>
 #include <cstdlib>
-#include <regex>
+#include <iomanip>
 
 bool VERBOSE;
+ServerConfig CONFIG;
 using namespace std;
 
+// Read-to-echo times of the blocking server, to compare with busy-poll mode
+static LatencyHistogram blockingTurnaround;
+
+// **************************************************************************************
+// * reportTurnaround()
+// * - Prints how long the server took from a read returning to its echo being written.
+// **************************************************************************************
+void reportTurnaround(const LatencyHistogram &histogram) {
+    if (histogram.total == 0) {
+        return;
+    }
+    cout << fixed << setprecision(1);
+    cout << "turnaround usec: p50 " << latencyPercentile(histogram, 0.50) / 1000.0
+         << "  p99 " << latencyPercentile(histogram, 0.99) / 1000.0
+         << "  p99.9 " << latencyPercentile(histogram, 0.999) / 1000.0
+         << "  max " << histogram.max / 1000.0 << "  (" << histogram.total << " reads)" << endl;
+}
+
+// **************************************************************************************
+// * statsReply()
+// * - The answer to STATS: the snapshot line, sent as a STATS frame in framing mode.
+// **************************************************************************************
+string statsReply() {
+    if (CONFIG.framed) {
+        return makeFrame(FRAME_STATS, statsSnapshot());
+    }
+    return statsSnapshot();
+}
+
+// **************************************************************************************
+// * setSocketTimeout()
+// * - Sets SO_RCVTIMEO or SO_SNDTIMEO on a blocking socket. 0 means wait forever.
+// **************************************************************************************
+static void setSocketTimeout(int sockFd, int option, uint64_t timeoutMs) {
+    struct timeval timeout = { (time_t)(timeoutMs / 1000), (suseconds_t)(timeoutMs % 1000 * 1000) };
+    setsockopt(sockFd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
 // **************************************************************************************
 // * processConnection()
 // * - Handles reading the line from the network and sending it back to the client.
@@ -17,19 +56,72 @@ using namespace std;
 bool processConnection(int sockFd) {
     bool quitProgram = false;
     bool keepGoing = true;
+    // The blocking server only ever has the one worker
+    WorkerStats &stats = workerStats(0);
+    countStat(stats.accepted);
+
+    // The parser carries a partly received line over to the next read
+    CommandParser parser;
+    initParser(parser);
+    FrameParser frames;
+    initFrameParser(frames);
+
+    // Echoes back whatever the parser says is data. write() may take only part of
+    // it, so keep going until all of it is out.
+    bool writeFailed = false;
+    auto echo = [&](const char *data, size_t length) {
+        while (!writeFailed && length > 0) {
+            ssize_t bytesWritten = write(sockFd, data, length);
+            if (bytesWritten == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    cout << "Client timed out" << endl;
+                    countStat(stats.timeouts);
+                    writeFailed = true;
+                    break;
+                }
+                cerr << "Error writing to socket" << endl;
+                countStat(stats.writeErrors);
+                writeFailed = true;
+                break;
+            }
+            countStat(stats.bytesOut, bytesWritten);
+            data += bytesWritten;
+            length -= bytesWritten;
+        }
+    };
 
+    // Between lines or frames a read waits for the idle timeout; part way through one
+    // it waits for the read timeout instead, if that is sooner
+    uint64_t receiveTimeoutMs = 0;
     while (keepGoing) {
+        uint64_t wantedMs = CONFIG.idleTimeoutMs;
+        if (CONFIG.readTimeoutMs > 0 && (wantedMs == 0 || CONFIG.readTimeoutMs < wantedMs) &&
+            inputUnfinished(parser, frames)) {
+            wantedMs = CONFIG.readTimeoutMs;
+        }
+        if (wantedMs != receiveTimeoutMs) {
+            setSocketTimeout(sockFd, SO_RCVTIMEO, wantedMs);
+            receiveTimeoutMs = wantedMs;
+        }
+
         // Creating buffer array to store data from the client
         char buffer[1024];  
-        // Setting elements in buffer to 0 to make sure it's cleared
-        memset(buffer, 0, sizeof(buffer));
 
         // Reading data from the client into the buffer
         ssize_t bytesRead = read(sockFd, buffer, sizeof(buffer));
 
         // Handling situation if there was a read error
         if (bytesRead == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                cout << "Client timed out" << endl;
+                countStat(stats.timeouts);
+                break;
+            }
             cerr << "Error reading from socket" << endl;
+            countStat(stats.readErrors);
             break;
         } 
         // If no bytes are read then the client has closed the connection
@@ -37,71 +129,95 @@ bool processConnection(int sockFd) {
             cout << "Client closed the connection" << endl;
             break;
         }  
-        // Checking if the client sent CLOSE or QUIT
+        // Echoing the data and checking if the client sent CLOSE or QUIT
         else {
-            string receivedData(buffer, bytesRead);
+            uint64_t readTime = monotonicNanos();
+            countStat(stats.bytesIn, bytesRead);
+            Command command = CMD_NONE;
+            ssize_t offset = 0;
+            while (offset < bytesRead && !writeFailed && command != CMD_CLOSE && command != CMD_QUIT) {
+                if (CONFIG.framed) {
+                    offset += parseFrames(frames, buffer + offset, bytesRead - offset, command, echo);
+                } else {
+                    offset += parseInput(parser, buffer + offset, bytesRead - offset, command, echo);
+                }
+                if (command != CMD_NONE) {
+                    countStat(stats.commands);
+                }
+                // STATS is answered in line with the echoed data. With one client at a
+                // time there is nobody to publish to, so the pub/sub commands get an error.
+                if (command == CMD_STATS) {
+                    string snapshot = statsReply();
+                    echo(snapshot.data(), snapshot.size());
+                } else if (isPubSubCommand(command)) {
+                    echo(kNoPubSubReply, sizeof(kNoPubSubReply) - 1);
+                }
+            }
+            recordLatency(blockingTurnaround, monotonicNanos() - readTime);
 
+            // Handling a writing error just in case
+            if (writeFailed) {
+                break;
+            }
             // If client sent CLOSE writing that out to console
-            if (receivedData.find("CLOSE") != string::npos) {
+            if (command == CMD_CLOSE) {
                 cout << "Client sent CLOSE" << endl;
                 break;
             } 
             // If client sent QUIT writing that out to console and raising quitProgram flag
-            else if (receivedData.find("QUIT") != string::npos) {
+            else if (command == CMD_QUIT) {
                 cout << "Client sent QUIT" << endl;
                 quitProgram = true;
                 break;
             } 
-            // If the data recieved is neither then we echo back to the client
-            else {
-                ssize_t bytesWritten = write(sockFd, buffer, bytesRead);
-                // Handling a writing error just in case
-                if (bytesWritten == -1) {
-                    cerr << "Error writing to socket" << endl;
-                    break;
-                }
-            }
         }
     }
 
     // Close the connection and return the appropriate value
     close(sockFd);
+    countStat(stats.closed);
     return quitProgram;
 }
 
 // **************************************************************************************
-// * main()
-// * - Sets up the sockets and accepts new connection until processConnection() returns 1
+// * createListenSocket()
+// * - Creates a TCP socket, binds it and puts it in the listening state. With type set
+// *   to SOCK_DGRAM it creates a bound UDP socket instead, which has nothing to listen for.
+// * - A port of 0 means pick a random one; the port actually used is written back.
+// * - With reusePort set, several sockets can listen on the same port at once.
+// * - Returns the listening descriptor, or -1 on failure.
 // **************************************************************************************
-int main(int argc, char *argv[]) {
-    // ********************************************************************
-    // * Process the command line arguments
-    // ********************************************************************
-    int opt = 0;
-    while ((opt = getopt(argc, argv, "v")) != -1) {
-        switch (opt) {
-        case 'v':
-            VERBOSE = true;
-            break;
-        case ':':
-        case '?':
-        default:
-            cout << "usage: " << argv[0] << " -v" << endl;
-            exit(-1);
-        }
-    }
-
+int createListenSocket(u_int16_t &port, bool reusePort, int type) {
     // *******************************************************************
     // * Creating the inital socket is the same as in a client.
     // ********************************************************************
-    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int listenFd = socket(AF_INET, type, 0);
     // Error handling in case listening socket can't be created
     if (listenFd == -1) {
         perror("socket");
-        exit(-1);
+        return -1;
     }
     DEBUG << "Calling Socket() assigned file descriptor " << listenFd << ENDL;
 
+    // A TCP port can be bound again straight away, while the last run's
+    // connections are still in TIME_WAIT
+    int enable = 1;
+    if (type == SOCK_STREAM && setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt(SO_REUSEADDR)");
+        close(listenFd);
+        return -1;
+    }
+
+    // Every worker binds its own socket to the same port and the kernel
+    // spreads incoming connections across them
+    if (reusePort) {
+        if (setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+            perror("setsockopt(SO_REUSEPORT)");
+            close(listenFd);
+            return -1;
+        }
+    }
+
     // ********************************************************************
     // * The bind() and calls take a structure that specifies the
     // * address to be used for the connection. On the cient it contains
@@ -109,8 +225,10 @@ int main(int argc, char *argv[]) {
     // * which IP address and port to lisen for connections.
     // ********************************************************************
     struct sockaddr_in servaddr;
-    srand(time(NULL));
-    u_int16_t port = (rand() % 10000) + 1024;
+    bool randomPort = (port == 0);
+    if (randomPort) {
+        port = (rand() % 10000) + 1024;
+    }
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -128,26 +246,218 @@ int main(int argc, char *argv[]) {
           bindSuccessful = true;
       } 
       // Handle bind failure, retry or choose a different port
-      else {
+      else if (randomPort) {
           port = (rand() % 10000) + 1024;
           servaddr.sin_port = htons(port);
       }
+      // A port that was asked for explicitly has to be used as is
+      else {
+          perror("bind");
+          close(listenFd);
+          return -1;
+      }
+    }
+
+    if (type == SOCK_DGRAM) {
+        return listenFd;
     }
-    cout << "Using port: " << port << endl;
 
     // ********************************************************************
     // * Setting the socket to the listening state is the second step
     // * needed to being accepting connections.  This creates a queue for
     // * connections and starts the kernel listening for connections.
     // ********************************************************************
-    int listenQueueLength = 1;
+    int listenQueueLength = SOMAXCONN;
     // Making sure that socket is set to listening state
     if (listen(listenFd, listenQueueLength) == -1) {
         perror("listen");
-        exit(-1);
+        close(listenFd);
+        return -1;
     }
     DEBUG << "Calling listen(" << listenFd << "," << listenQueueLength << ")" << ENDL;
 
+    return listenFd;
+}
+
+// **************************************************************************************
+// * main()
+// * - Sets up the sockets and serves clients until one of them sends QUIT.
+// * - By default every client is served from one epoll event loop. With -t N the server
+// *   runs N event loops on N threads (-t 0 means one per core), each with its own
+// *   SO_REUSEPORT listening socket. -m uring swaps epoll for io_uring when the kernel
+// *   supports it. -z turns on the zero-copy splice() path for large bursts in the epoll
+// *   loops. -H and -L set the output high and low watermarks in bytes. -p picks the
+// *   port instead of a random one. With -b the server falls back to accepting one connection at a time and
+// *   calling processConnection().
+// * - -I, -R and -W set the idle, read and write timeouts in seconds: a connection with
+// *   no traffic for the idle timeout, whose client has sent part of a line or frame and
+// *   nothing more for the read timeout, or whose client hasn't read any of its pending
+// *   output for the write timeout, is closed. All are off by default.
+// * - -B sets the size of the pooled output buffers in bytes and -S how many free slabs of
+// *   them each worker keeps around between bursts.
+// * - -m busy is the epoll loop for latency over throughput: each loop is pinned to a core
+// *   (-C picks the first one) and spins on its non-blocking sockets instead of sleeping,
+// *   with SO_BUSY_POLL and SO_PREFER_BUSY_POLL set where the kernel has them. Busy-poll
+// *   and -b print their read-to-echo turnaround times on exit.
+// * - -u serves UDP instead: every datagram is echoed back to its sender, N threads each
+// *   with their own SO_REUSEPORT socket. -g adds UDP_GRO/UDP_SEGMENT batching to it.
+// * - -f makes TCP clients speak length-prefixed binary frames instead of lines; the
+// *   format is described in frame_parser.h.
+// **************************************************************************************
+int main(int argc, char *argv[]) {
+    // ********************************************************************
+    // * Process the command line arguments
+    // ********************************************************************
+    CONFIG.highWatermark = 256 * 1024;
+    CONFIG.lowWatermark = 64 * 1024;
+    CONFIG.poolBufferSize = 16 * 1024;
+    CONFIG.poolSpareSlabs = 4;
+    bool blockingMode = false;
+    bool uringMode = false;
+    bool udpMode = false;
+    u_int16_t port = 0;
+    int threadCount = 1;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "vbzufgt:m:H:L:I:R:W:B:S:C:p:")) != -1) {
+        switch (opt) {
+        case 'v':
+            VERBOSE = true;
+            break;
+        case 'b':
+            blockingMode = true;
+            break;
+        case 'z':
+            CONFIG.zeroCopy = true;
+            break;
+        case 'u':
+            udpMode = true;
+            break;
+        case 'f':
+            CONFIG.framed = true;
+            break;
+        case 'g':
+            CONFIG.segmentOffload = true;
+            break;
+        case 't':
+            threadCount = atoi(optarg);
+            if (threadCount == 0) {
+                threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            if (threadCount < 1) {
+                cout << "thread count must be at least 1" << endl;
+                exit(-1);
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "uring") == 0) {
+                uringMode = true;
+                CONFIG.busyPoll = false;
+            } else if (strcmp(optarg, "busy") == 0) {
+                CONFIG.busyPoll = true;
+                uringMode = false;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                uringMode = false;
+                CONFIG.busyPoll = false;
+            } else {
+                cout << "unknown mode " << optarg << ", expected epoll, uring or busy" << endl;
+                exit(-1);
+            }
+            break;
+        case 'H':
+            CONFIG.highWatermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            CONFIG.lowWatermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'I':
+            CONFIG.idleTimeoutMs = atof(optarg) * 1000;
+            break;
+        case 'R':
+            CONFIG.readTimeoutMs = atof(optarg) * 1000;
+            break;
+        case 'W':
+            CONFIG.writeTimeoutMs = atof(optarg) * 1000;
+            break;
+        case 'B':
+            CONFIG.poolBufferSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            CONFIG.poolSpareSlabs = strtoul(optarg, NULL, 10);
+            break;
+        case 'C':
+            CONFIG.firstCore = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case ':':
+        case '?':
+        default:
+            cout << "usage: " << argv[0] << " [-v] [-b] [-z] [-u] [-g] [-f] [-t threads] [-m epoll|uring|busy] [-C first core] [-H high] [-L low] [-I idle sec] [-R read sec] [-W write sec] [-B buffer bytes] [-S spare slabs] [-p port]" << endl;
+            exit(-1);
+        }
+    }
+
+    if (CONFIG.highWatermark == 0 || CONFIG.lowWatermark > CONFIG.highWatermark) {
+        cout << "watermarks must satisfy 0 <= low <= high and high > 0" << endl;
+        exit(-1);
+    }
+    if (CONFIG.poolBufferSize < 256) {
+        cout << "pool buffers must be at least 256 bytes" << endl;
+        exit(-1);
+    }
+    if (udpMode && blockingMode) {
+        cout << "-u and -b can't be used together" << endl;
+        exit(-1);
+    }
+    // Datagrams already have boundaries
+    if (udpMode && CONFIG.framed) {
+        cout << "-u and -f can't be used together" << endl;
+        exit(-1);
+    }
+
+    // ********************************************************************
+    // * One listening socket per event loop. They all share the port that
+    // * the first one picked.
+    // ********************************************************************
+    srand(time(NULL));
+    int socketCount = blockingMode ? 1 : threadCount;
+    initWorkerStats(socketCount);
+    vector<int> listenFds;
+    for (int i = 0; i < socketCount; i++) {
+        int listenFd = createListenSocket(port, socketCount > 1, udpMode ? SOCK_DGRAM : SOCK_STREAM);
+        if (listenFd == -1) {
+            exit(-1);
+        }
+        listenFds.push_back(listenFd);
+    }
+    int listenFd = listenFds[0];
+    cout << "Using port: " << port << endl;
+
+    if (udpMode) {
+        bool cleanExit = runUdpLoops(listenFds);
+        for (size_t i = 0; i < listenFds.size(); i++) {
+            close(listenFds[i]);
+        }
+        return cleanExit ? 0 : -1;
+    }
+
+    // ********************************************************************
+    // * The event loops accept and serve every client themselves, and only
+    // * return once a client has sent QUIT.
+    // ********************************************************************
+    if (uringMode && !blockingMode && !uringAvailable()) {
+        cout << "io_uring is not available, falling back to epoll" << endl;
+        uringMode = false;
+    }
+    if (!blockingMode) {
+        bool cleanExit = uringMode ? runUringLoops(listenFds) : runEventLoops(listenFds);
+        for (size_t i = 0; i < listenFds.size(); i++) {
+            close(listenFds[i]);
+        }
+        return cleanExit ? 0 : -1;
+    }
+
     // ********************************************************************
     // * The accept call will sleep, waiting for a connection.  When 
     // * a connection request comes in the accept() call creates a NEW
@@ -170,11 +480,16 @@ int main(int argc, char *argv[]) {
 
       DEBUG << "We have received a connection on " << connFd << ENDL;
 
+      // One client at a time, so the socket timeouts do the job of the timing wheel.
+      // processConnection() sets the receive timeout as it reads.
+      setSocketTimeout(connFd, SO_SNDTIMEO, CONFIG.writeTimeoutMs);
+
       quitProgram = processConnection(connFd);
     }
 
     // Close the listening socket
     close(listenFd);
+    reportTurnaround(blockingTurnaround);
 
     return 0;
 }
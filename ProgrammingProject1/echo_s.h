@@ -26,3 +26,140 @@ extern bool VERBOSE;
 #define FATAL if (true) { std::cout
 #define ENDL  " (" << __FILE__ << ":" << __LINE__ << ")" << std::endl; }
 
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "command_parser.h"
+#include "frame_parser.h"
+#include "output_buffer.h"
+#include "stats.h"
+#include "timing_wheel.h"
+#include "latency_histogram.h"
+
+// ********************************************************
+// * Settings chosen on the command line.
+// ********************************************************
+struct ServerConfig {
+    bool zeroCopy;
+    // Clients speak length-prefixed binary frames instead of
+    // lines
+    bool framed;
+    // UDP mode receives coalesced datagrams (UDP_GRO) and
+    // sends them back as one segmented send (UDP_SEGMENT)
+    bool segmentOffload;
+    // A connection stops reading once this much output is
+    // queued for it, and starts again at lowWatermark
+    size_t highWatermark;
+    size_t lowWatermark;
+    // A connection with no traffic either way for idleTimeoutMs
+    // is closed, and so is one that has sent part of a line or
+    // frame and nothing more for readTimeoutMs, and one whose
+    // client hasn't taken any of its pending output for
+    // writeTimeoutMs. 0 turns any of them off.
+    uint64_t idleTimeoutMs;
+    uint64_t readTimeoutMs;
+    uint64_t writeTimeoutMs;
+    // Each worker's output buffers come from a slab pool of
+    // poolBufferSize byte buffers, which keeps up to
+    // poolSpareSlabs free slabs around between bursts
+    size_t poolBufferSize;
+    size_t poolSpareSlabs;
+    // Event loops spin instead of sleeping in epoll_wait(),
+    // each pinned to its own core starting at firstCore
+    bool busyPoll;
+    int firstCore;
+};
+extern ServerConfig CONFIG;
+
+// ********************************************************
+// * Per-connection state kept by the event loop. Anything
+// * that couldn't be written immediately waits in output
+// * until the socket reports EPOLLOUT. In zero-copy mode
+// * large bursts wait in a pipe instead, and piped counts
+// * the bytes in it; the pipe is only held while it has
+// * something in it. interest mirrors what epoll is
+// * currently asked to report. lastRead and lastWrite are
+// * the timer ticks of the last progress each way; the
+// * timer is only moved when it has to fire sooner.
+// * channels lists what the client is subscribed to, and
+// * flushQueued is set while the connection is waiting for
+// * the messages just queued for it to be written. In
+// * framing mode frames parses the input instead of parser.
+// ********************************************************
+struct Connection {
+    int fd;
+    CommandParser parser;
+    FrameParser frames;
+    OutputBuffer output;
+    bool readPaused;
+    uint32_t interest;
+    bool closing;
+    int pipeFds[2];
+    size_t pipeSize;
+    size_t piped;
+    TimerEntry timer;
+    uint64_t lastRead;
+    uint64_t lastWrite;
+    std::vector<std::string> channels;
+    bool flushQueued;
+};
+
+// ********************************************************
+// * An empty splice pipe kept for the next connection that
+// * needs one.
+// ********************************************************
+struct SparePipe {
+    int fds[2];
+    size_t size;
+};
+
+// ********************************************************
+// * State for one epoll event loop. Each loop runs on its
+// * own thread with its own listening socket, and is only
+// * ever touched by that thread apart from wakeFd, which
+// * other loops write to when a client sends QUIT or there
+// * is a message in the loop's inbox for its subscribers.
+// * Connections are indexed by file descriptor so lookups
+// * are O(1).
+// ********************************************************
+struct EventLoop {
+    int id;
+    WorkerStats *stats;
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    bool draining;
+    size_t activeConnections;
+    TimingWheel timers;
+    // Timer tick as of the last return from epoll_wait()
+    uint64_t nowTick;
+    BufferPool pool;
+    std::vector<SparePipe> sparePipes;
+    // Time from a read returning to its echo being written, in
+    // busy-poll mode only
+    LatencyHistogram *turnaround;
+    // Published messages from other loops, this loop's
+    // subscribers by channel, and the subscribers that have
+    // been queued messages since their output was last written
+    Inbox *inbox;
+    std::unordered_map<std::string, std::vector<Connection *> > channels;
+    std::vector<Connection *> flushQueue;
+    std::vector<Connection *> connections;
+    std::vector<Connection *> closed;
+};
+
+// ***********************************************************
+// ** Functions shared between echo_s.cc and the event loops.
+// ***********************************************************
+bool processConnection(int sockFd);
+int createListenSocket(u_int16_t &port, bool reusePort, int type = SOCK_STREAM);
+bool setNonBlocking(int fd);
+std::string statsReply();
+bool inputUnfinished(const CommandParser &parser, const FrameParser &frames);
+uint64_t timeoutDeadline(uint64_t lastRead, uint64_t lastWrite, bool owesOutput, bool inputPending);
+void reportTurnaround(const LatencyHistogram &histogram);
+bool runEventLoops(const std::vector<int> &listenFds);
+bool uringAvailable();
+bool runUringLoops(const std::vector<int> &listenFds);
+bool runUdpLoops(const std::vector<int> &udpFds);
@@ -0,0 +1,1075 @@
+#include "echo_s.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std;
+
+// Number of events handled per epoll_wait() call
+static const int kMaxEvents = 256;
+// Size of the scratch buffer used for every read
+static const size_t kReadChunk = 16384;
+// How long a QUIT waits for slow readers before closing them anyway
+static const int kDrainTimeoutMs = 5000;
+// Pipe size asked for in zero-copy mode; the kernel may give us less
+static const int kPipeSize = 1 << 20;
+// Empty pipes each loop keeps for reuse instead of closing
+static const size_t kSparePipes = 64;
+// How long the kernel may busy poll the device queue on a blocking socket call, in usec
+static const int kBusyPollUsec = 50;
+// Most of a burst peeked at and parsed before it is spliced
+static const size_t kSplicePeek = 65536;
+// Slots in each loop's timing wheel; one turn is kTimerSlots * kTimerTickMs
+static const size_t kTimerSlots = 1024;
+
+// Every running loop, filled in before any thread starts and never changed after
+static vector<EventLoop *> eventLoops;
+// Set by whichever loop sees a QUIT first
+static atomic<bool> quitRequested(false);
+
+// **************************************************************************************
+// * setNonBlocking()
+// * - Puts the descriptor in O_NONBLOCK mode. Returns false if fcntl() fails.
+// **************************************************************************************
+bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return false;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// **************************************************************************************
+// * wakeLoop()
+// * - Makes the loop's epoll_wait() return so it notices a QUIT or a published message.
+// **************************************************************************************
+static void wakeLoop(EventLoop &loop) {
+    uint64_t one = 1;
+    if (write(loop.wakeFd, &one, sizeof(one)) == -1) {
+        perror("write(eventfd)");
+    }
+}
+
+// **************************************************************************************
+// * requestQuit()
+// * - Tells every loop, including the calling one, to stop accepting and drain.
+// **************************************************************************************
+static void requestQuit() {
+    if (quitRequested.exchange(true)) {
+        return;
+    }
+    for (size_t i = 0; i < eventLoops.size(); i++) {
+        wakeLoop(*eventLoops[i]);
+    }
+}
+
+// **************************************************************************************
+// * setBusyPoll()
+// * - Asks the kernel to busy poll the NIC queue for this socket rather than wait for an
+// *   interrupt. Needs driver support and, above net.core.busy_poll, CAP_NET_ADMIN; the
+// *   spinning loop still works without it, so failures are only reported.
+// **************************************************************************************
+static void setBusyPoll(int fd) {
+    static bool reported = false;
+    int usec = kBusyPollUsec;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1 && !reported) {
+        perror("setsockopt(SO_BUSY_POLL)");
+        reported = true;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int enable = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable)) == -1 && !reported) {
+        perror("setsockopt(SO_PREFER_BUSY_POLL)");
+        reported = true;
+    }
+#endif
+}
+
+// **************************************************************************************
+// * pinToCore()
+// * - Keeps the calling thread on one core so a spinning loop never migrates.
+// **************************************************************************************
+static void pinToCore(int core) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+        cerr << "Could not pin to core " << core << ": " << strerror(error) << endl;
+    }
+}
+
+// **************************************************************************************
+// * hasOutput()
+// * - True while the connection still owes its client bytes, either in the splice pipe
+// *   or in the output buffer. Pipe contents always go out first.
+// **************************************************************************************
+static bool hasOutput(Connection *conn) {
+    return conn->piped > 0 || bufferedBytes(conn->output) > 0;
+}
+
+// **************************************************************************************
+// * inputUnfinished()
+// * - True while the client is part way through a line, or a frame in framing mode.
+// **************************************************************************************
+bool inputUnfinished(const CommandParser &parser, const FrameParser &frames) {
+    return CONFIG.framed ? midFrame(frames) : midLine(parser);
+}
+
+// **************************************************************************************
+// * timeoutDeadline()
+// * - Timer tick at which a connection times out, given the ticks of its last progress
+// *   each way, or 0 if it never does. The read timeout only runs while the client is
+// *   part way through a line or frame, and the write timeout only while the connection
+// *   owes its client output.
+// **************************************************************************************
+uint64_t timeoutDeadline(uint64_t lastRead, uint64_t lastWrite, bool owesOutput, bool inputPending) {
+    uint64_t deadline = 0;
+    auto earliest = [&](uint64_t since, uint64_t timeoutMs) {
+        uint64_t expires = since + (timeoutMs + kTimerTickMs - 1) / kTimerTickMs;
+        if (deadline == 0 || expires < deadline) {
+            deadline = expires;
+        }
+    };
+    if (CONFIG.idleTimeoutMs > 0) {
+        earliest(max(lastRead, lastWrite), CONFIG.idleTimeoutMs);
+    }
+    if (CONFIG.readTimeoutMs > 0 && inputPending) {
+        earliest(lastRead, CONFIG.readTimeoutMs);
+    }
+    if (CONFIG.writeTimeoutMs > 0 && owesOutput) {
+        earliest(lastWrite, CONFIG.writeTimeoutMs);
+    }
+    return deadline;
+}
+
+// **************************************************************************************
+// * scheduleTimeout()
+// * - Makes sure the connection's timer fires no later than its deadline. Progress only
+// *   ever pushes a deadline back, so that is left for expireConnection() to notice.
+// **************************************************************************************
+static void scheduleTimeout(EventLoop &loop, Connection *conn) {
+    uint64_t deadline = timeoutDeadline(conn->lastRead, conn->lastWrite, hasOutput(conn),
+                                        inputUnfinished(conn->parser, conn->frames));
+    if (deadline != 0 && (!timerArmed(conn->timer) || deadline < conn->timer.expiresTick)) {
+        armTimer(loop.timers, conn->timer, deadline);
+    }
+}
+
+// **************************************************************************************
+// * updateInterest()
+// * - Asks epoll for EPOLLOUT only while there is pending output, and for EPOLLIN only
+// *   while the connection isn't closing or waiting for its client to catch up.
+// * - epoll_ctl() is only called when the set actually changes.
+// **************************************************************************************
+static void updateInterest(EventLoop &loop, Connection *conn) {
+    // A full pipe means the client isn't reading, so stop reading from it too
+    bool pipeFull = conn->pipeSize > 0 && conn->piped >= conn->pipeSize;
+    uint32_t interest = 0;
+    if (!conn->closing && !conn->readPaused && !pipeFull) {
+        interest |= EPOLLIN;
+    }
+    if (hasOutput(conn)) {
+        interest |= EPOLLOUT;
+    }
+    if (interest == conn->interest) {
+        return;
+    }
+
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = interest;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop.epollFd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+    }
+    conn->interest = interest;
+}
+
+// **************************************************************************************
+// * releasePipe()
+// * - Gives up the connection's splice pipe. An empty one is kept for reuse; one with
+// *   bytes still in it can only be closed.
+// **************************************************************************************
+static void releasePipe(EventLoop &loop, Connection *conn) {
+    if (conn->pipeFds[0] == -1) {
+        return;
+    }
+    if (conn->piped == 0 && loop.sparePipes.size() < kSparePipes) {
+        SparePipe spare;
+        spare.fds[0] = conn->pipeFds[0];
+        spare.fds[1] = conn->pipeFds[1];
+        spare.size = conn->pipeSize;
+        loop.sparePipes.push_back(spare);
+    } else {
+        close(conn->pipeFds[0]);
+        close(conn->pipeFds[1]);
+    }
+    conn->pipeFds[0] = conn->pipeFds[1] = -1;
+    conn->pipeSize = 0;
+    conn->piped = 0;
+}
+
+// **************************************************************************************
+// * subscribe()
+// * - Adds the connection to a channel's subscribers on this loop.
+// **************************************************************************************
+static void subscribe(EventLoop &loop, Connection *conn, const string &channel) {
+    if (find(conn->channels.begin(), conn->channels.end(), channel) != conn->channels.end()) {
+        return;
+    }
+    loop.channels[channel].push_back(conn);
+    conn->channels.push_back(channel);
+    DEBUG << "Connection on " << conn->fd << " subscribed to " << channel << ENDL;
+}
+
+// **************************************************************************************
+// * unsubscribe()
+// * - Takes the connection off a channel, and forgets the channel once nobody on this
+// *   loop is left on it. channel may be one of the connection's own names, so that
+// *   list is changed last.
+// **************************************************************************************
+static void unsubscribe(EventLoop &loop, Connection *conn, const string &channel) {
+    vector<string>::iterator name = find(conn->channels.begin(), conn->channels.end(), channel);
+    if (name == conn->channels.end()) {
+        return;
+    }
+
+    unordered_map<string, vector<Connection *> >::iterator found = loop.channels.find(channel);
+    vector<Connection *> &subscribers = found->second;
+    *find(subscribers.begin(), subscribers.end(), conn) = subscribers.back();
+    subscribers.pop_back();
+    if (subscribers.empty()) {
+        loop.channels.erase(found);
+    }
+
+    *name = conn->channels.back();
+    conn->channels.pop_back();
+}
+
+// **************************************************************************************
+// * closeConnection()
+// * - Removes the connection from the loop. The object itself is freed after the current
+// *   batch of events, since a later event in the batch may still point at it.
+// **************************************************************************************
+static void closeConnection(EventLoop &loop, Connection *conn) {
+    DEBUG << "Closing connection on " << conn->fd << ENDL;
+
+    // Closing the descriptor also removes it from the epoll set
+    loop.connections[conn->fd] = NULL;
+    close(conn->fd);
+    conn->fd = -1;
+    countStat(loop.stats->closed);
+    cancelTimer(loop.timers, conn->timer);
+    while (!conn->channels.empty()) {
+        unsubscribe(loop, conn, conn->channels.back());
+    }
+    releaseOutputBuffer(conn->output);
+    releasePipe(loop, conn);
+    loop.activeConnections--;
+    loop.closed.push_back(conn);
+}
+
+// **************************************************************************************
+// * releaseClosed()
+// * - Frees the connections closed during the last batch of events.
+// **************************************************************************************
+static void releaseClosed(EventLoop &loop) {
+    for (size_t i = 0; i < loop.closed.size(); i++) {
+        delete loop.closed[i];
+    }
+    loop.closed.clear();
+}
+
+// **************************************************************************************
+// * flushPending()
+// * - Writes as much pending output as the socket will take, and lets a paused client
+// *   send again once its backlog is down to the low watermark.
+// * - Returns false if the connection was closed because of a write error.
+// **************************************************************************************
+static bool flushPending(EventLoop &loop, Connection *conn) {
+    while (conn->piped > 0) {
+        ssize_t bytesSpliced = splice(conn->pipeFds[0], NULL, conn->fd, NULL, conn->piped,
+                                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytesSpliced == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                updateInterest(loop, conn);
+                return true;
+            }
+            cerr << "Error writing to socket" << endl;
+            countStat(loop.stats->writeErrors);
+            closeConnection(loop, conn);
+            return false;
+        }
+        conn->piped -= bytesSpliced;
+        conn->lastWrite = loop.nowTick;
+        countStat(loop.stats->bytesOut, bytesSpliced);
+        if (conn->piped == 0) {
+            releasePipe(loop, conn);
+        }
+    }
+
+    struct iovec spans[kMaxOutputSpans];
+    int spanCount;
+    while ((spanCount = outputSpans(conn->output, spans)) > 0) {
+        ssize_t bytesWritten = writev(conn->fd, spans, spanCount);
+        if (bytesWritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            cerr << "Error writing to socket" << endl;
+            countStat(loop.stats->writeErrors);
+            closeConnection(loop, conn);
+            return false;
+        }
+        consumeOutput(conn->output, bytesWritten);
+        conn->lastWrite = loop.nowTick;
+        countStat(loop.stats->bytesOut, bytesWritten);
+    }
+
+    if (conn->readPaused && bufferedBytes(conn->output) <= CONFIG.lowWatermark) {
+        DEBUG << "Resuming reads on " << conn->fd << ENDL;
+        conn->readPaused = false;
+    }
+
+    // A closing connection goes away as soon as its last byte is out
+    if (conn->closing && !hasOutput(conn)) {
+        closeConnection(loop, conn);
+        return false;
+    }
+    updateInterest(loop, conn);
+    return true;
+}
+
+// **************************************************************************************
+// * sendData()
+// * - Writes straight to the socket when nothing is queued, otherwise appends to the
+// *   output buffer so bytes go out in the order they arrived.
+// * - Once the buffer reaches the high watermark the connection stops reading, so a
+// *   client that sends without reading can't make the server buffer without bound.
+// **************************************************************************************
+static bool sendData(EventLoop &loop, Connection *conn, const char *data, size_t length) {
+    bool wasEmpty = !hasOutput(conn);
+    if (wasEmpty) {
+        ssize_t bytesWritten = write(conn->fd, data, length);
+        if (bytesWritten == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                cerr << "Error writing to socket" << endl;
+                countStat(loop.stats->writeErrors);
+                closeConnection(loop, conn);
+                return false;
+            }
+            bytesWritten = 0;
+        }
+        if (bytesWritten > 0) {
+            conn->lastWrite = loop.nowTick;
+        }
+        countStat(loop.stats->bytesOut, bytesWritten);
+        data += bytesWritten;
+        length -= bytesWritten;
+    }
+
+    if (length > 0) {
+        appendOutput(conn->output, data, length);
+        if (!conn->readPaused && bufferedBytes(conn->output) >= CONFIG.highWatermark) {
+            DEBUG << "Pausing reads on " << conn->fd << ", " << bufferedBytes(conn->output) << " bytes queued" << ENDL;
+            conn->readPaused = true;
+        }
+        // The client has until the read timeout to start taking this
+        if (wasEmpty) {
+            conn->lastWrite = loop.nowTick;
+            scheduleTimeout(loop, conn);
+        }
+        updateInterest(loop, conn);
+    }
+    return true;
+}
+
+// **************************************************************************************
+// * queueMessage()
+// * - Queues a reference to a published message for one subscriber, to be written by
+// *   flushSubscribers(). A subscriber that already has the high watermark's worth of
+// *   output waiting misses the message instead of queueing without bound.
+// **************************************************************************************
+static void queueMessage(EventLoop &loop, Connection *conn, MessageHandle *handle) {
+    if (conn->closing) {
+        return;
+    }
+    if (bufferedBytes(conn->output) >= CONFIG.highWatermark) {
+        countStat(loop.stats->dropped);
+        return;
+    }
+
+    bool wasEmpty = !hasOutput(conn);
+    appendShared(conn->output, handle, 0);
+    countStat(loop.stats->delivered);
+    // The client has until the read timeout to start taking this
+    if (wasEmpty) {
+        conn->lastWrite = loop.nowTick;
+        scheduleTimeout(loop, conn);
+    }
+    if (!conn->flushQueued) {
+        conn->flushQueued = true;
+        loop.flushQueue.push_back(conn);
+    }
+}
+
+// **************************************************************************************
+// * deliverMessage()
+// * - Queues the message for every subscriber to its channel on this loop, then gives
+// *   up the reference the loop's handle came with.
+// * - Nothing is written yet, so no subscriber can be closed, and no channel list
+// *   changed, while the list is being walked.
+// **************************************************************************************
+static void deliverMessage(EventLoop &loop, MessageHandle *handle) {
+    SharedMessage *message = handle->message;
+    unordered_map<string, vector<Connection *> >::iterator found =
+        loop.channels.find(string(messageChannel(message), message->channelLength));
+    if (found != loop.channels.end()) {
+        vector<Connection *> &subscribers = found->second;
+        for (size_t i = 0; i < subscribers.size(); i++) {
+            queueMessage(loop, subscribers[i], handle);
+        }
+    }
+    releaseHandle(handle);
+}
+
+// **************************************************************************************
+// * flushSubscribers()
+// * - Writes out the messages just queued, with one writev() per subscriber however
+// *   many messages it was given.
+// **************************************************************************************
+static void flushSubscribers(EventLoop &loop) {
+    for (size_t i = 0; i < loop.flushQueue.size(); i++) {
+        Connection *conn = loop.flushQueue[i];
+        conn->flushQueued = false;
+        if (conn->fd != -1) {
+            flushPending(loop, conn);
+        }
+    }
+    loop.flushQueue.clear();
+}
+
+// **************************************************************************************
+// * publishMessage()
+// * - Handles "PUBLISH channel payload". The payload is copied once, into a message
+// *   with a handle for every loop: this loop's subscribers get theirs straight away and
+// *   the other loops get theirs through their inboxes. A loop is only woken when its
+// *   inbox was empty; otherwise a wakeup is already on its way.
+// **************************************************************************************
+static void publishMessage(EventLoop &loop, const char *argument, size_t length) {
+    const char *space = (const char *)memchr(argument, ' ', length);
+    size_t channelLength = space == NULL ? length : space - argument;
+    const char *payload = space == NULL ? argument + length : space + 1;
+    SharedMessage *message = createMessage(argument, channelLength, payload, argument + length - payload,
+                                           eventLoops.size());
+    countStat(loop.stats->published);
+
+    for (size_t i = 0; i < eventLoops.size(); i++) {
+        if ((int)i != loop.id && postMessage(*eventLoops[i]->inbox, messageHandle(message, i))) {
+            wakeLoop(*eventLoops[i]);
+        }
+    }
+    deliverMessage(loop, messageHandle(message, loop.id));
+    flushSubscribers(loop);
+}
+
+// **************************************************************************************
+// * deliverInbox()
+// * - Hands this loop's subscribers everything other loops have published since the
+// *   last call.
+// **************************************************************************************
+static void deliverInbox(EventLoop &loop) {
+    MessageHandle *handle = takeMessages(*loop.inbox);
+    if (handle == NULL) {
+        return;
+    }
+    while (handle != NULL) {
+        // Delivering may free the message the handle lives in
+        MessageHandle *next = handle->next;
+        deliverMessage(loop, handle);
+        handle = next;
+    }
+    flushSubscribers(loop);
+}
+
+// **************************************************************************************
+// * beginClose()
+// * - Stops reading from the connection and closes it once pending output drains.
+// **************************************************************************************
+static void beginClose(EventLoop &loop, Connection *conn) {
+    conn->closing = true;
+    flushPending(loop, conn);
+}
+
+// **************************************************************************************
+// * handleInput()
+// * - Runs bytes read from a client through its parser, echoing the data and acting on
+// *   any commands. Anything after a CLOSE or QUIT is dropped. A PUBLISH reaches this
+// *   client's own subscriptions in order with its echoed data.
+// **************************************************************************************
+static void handleInput(EventLoop &loop, Connection *conn, const char *data, size_t length) {
+    // sendData() may close the connection, after which nothing more is sent
+    auto echo = [&](const char *bytes, size_t count) {
+        if (conn->fd != -1) {
+            sendData(loop, conn, bytes, count);
+        }
+    };
+
+    size_t offset = 0;
+    while (offset < length) {
+        Command command;
+        if (CONFIG.framed) {
+            offset += parseFrames(conn->frames, data + offset, length - offset, command, echo);
+        } else {
+            offset += parseInput(conn->parser, data + offset, length - offset, command, echo);
+        }
+        if (conn->fd == -1) {
+            return;
+        }
+        if (command != CMD_NONE) {
+            countStat(loop.stats->commands);
+        }
+
+        switch (command) {
+        case CMD_CLOSE:
+            DEBUG << "Client on " << conn->fd << " sent CLOSE" << ENDL;
+            beginClose(loop, conn);
+            return;
+        case CMD_QUIT:
+            cout << "Client sent QUIT" << endl;
+            requestQuit();
+            beginClose(loop, conn);
+            return;
+        case CMD_STATS: {
+            string snapshot = statsReply();
+            sendData(loop, conn, snapshot.data(), snapshot.size());
+            if (conn->fd == -1) {
+                return;
+            }
+            break;
+        }
+        case CMD_SUBSCRIBE:
+            subscribe(loop, conn, string(conn->parser.argumentData, conn->parser.argumentLength));
+            break;
+        case CMD_UNSUBSCRIBE:
+            unsubscribe(loop, conn, string(conn->parser.argumentData, conn->parser.argumentLength));
+            break;
+        case CMD_PUBLISH:
+            publishMessage(loop, conn->parser.argumentData, conn->parser.argumentLength);
+            if (conn->fd == -1) {
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// **************************************************************************************
+// * openPipe()
+// * - Gives the connection a pipe to splice through, reusing a spare one if the loop has
+// *   one and creating it otherwise.
+// **************************************************************************************
+static bool openPipe(EventLoop &loop, Connection *conn) {
+    if (!loop.sparePipes.empty()) {
+        conn->pipeFds[0] = loop.sparePipes.back().fds[0];
+        conn->pipeFds[1] = loop.sparePipes.back().fds[1];
+        conn->pipeSize = loop.sparePipes.back().size;
+        loop.sparePipes.pop_back();
+        return true;
+    }
+    if (pipe2(conn->pipeFds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        conn->pipeFds[0] = conn->pipeFds[1] = -1;
+        return false;
+    }
+
+    // A bigger pipe means fewer splice() calls per burst
+    fcntl(conn->pipeFds[1], F_SETPIPE_SZ, kPipeSize);
+    conn->pipeSize = fcntl(conn->pipeFds[1], F_GETPIPE_SZ);
+    DEBUG << "Connection on " << conn->fd << " splicing through a " << conn->pipeSize << " byte pipe" << ENDL;
+    return true;
+}
+
+// **************************************************************************************
+// * splicePrefix()
+// * - How many of the peeked bytes can be spliced: everything the parser would echo,
+// *   which stops before the first command line and before a line at the end that
+// *   could still turn out to be one.
+// **************************************************************************************
+static size_t splicePrefix(const CommandParser &parser, const char *data, size_t length) {
+    CommandParser peekParser = parser;
+    Command command;
+    size_t echoed = 0;
+    parseInput(peekParser, data, length, command, [&echoed](const char *, size_t count) { echoed += count; });
+    return echoed;
+}
+
+// **************************************************************************************
+// * skipSpliced()
+// * - Moves the parser past bytes that were spliced, all of them data. A line cut off
+// *   at the end is known to go on as data, so it isn't held back as a possible command.
+// **************************************************************************************
+static void skipSpliced(CommandParser &parser, const char *data, size_t length) {
+    Command command;
+    parseInput(parser, data, length, command, [](const char *, size_t) {});
+    if (parser.heldLength > 0 || parser.inArgument) {
+        parser.heldLength = 0;
+        parser.inArgument = false;
+        parser.inData = true;
+        string().swap(parser.argument);
+    }
+}
+
+// **************************************************************************************
+// * spliceReadable()
+// * - Zero-copy path. When more than one read buffer's worth of data is waiting, moves
+// *   it socket to pipe to socket with splice() so it never goes back out through user
+// *   space.
+// * - The burst is peeked at and run through a copy of the parser first, and only the
+// *   data ahead of the first command, or of a line that might be one, is spliced. The
+// *   parser is then moved past exactly what was spliced, so a command later in the
+// *   burst, or a line split across reads, is handled as it would be without -z.
+// * - In framing mode nothing needs peeking at: the rest of a data frame's payload is
+// *   spliced as it is, and never more than the frame has left.
+// * - Returns false if the data should go through the copying path instead.
+// **************************************************************************************
+static bool spliceReadable(EventLoop &loop, Connection *conn) {
+    if (bufferedBytes(conn->output) > 0 || conn->parser.heldLength > 0 || conn->parser.inArgument) {
+        return false;
+    }
+    if (CONFIG.framed && !inDataPayload(conn->frames)) {
+        return false;
+    }
+
+    int available = 0;
+    if (ioctl(conn->fd, FIONREAD, &available) == -1 || (size_t)available < kReadChunk) {
+        return false;
+    }
+    if (conn->pipeFds[0] == -1 && !openPipe(loop, conn)) {
+        return false;
+    }
+
+    size_t limit = min((size_t)available, conn->pipeSize - conn->piped);
+    static thread_local char peeked[kSplicePeek];
+    if (CONFIG.framed) {
+        limit = min(limit, (size_t)conn->frames.remaining);
+    } else {
+        ssize_t peekedLength = recv(conn->fd, peeked, min(limit, sizeof(peeked)), MSG_PEEK);
+        if (peekedLength <= 0) {
+            return false;
+        }
+        // A command near the start is left to the copying path, which reads past it
+        limit = splicePrefix(conn->parser, peeked, peekedLength);
+        if (limit < kReadChunk) {
+            return false;
+        }
+    }
+
+    ssize_t bytesSpliced = splice(conn->fd, NULL, conn->pipeFds[1], NULL, limit, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytesSpliced == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            updateInterest(loop, conn);
+            return true;
+        }
+        cerr << "Error reading from socket" << endl;
+        countStat(loop.stats->readErrors);
+        closeConnection(loop, conn);
+        return true;
+    }
+
+    if (conn->piped == 0) {
+        conn->lastWrite = loop.nowTick;
+    }
+    conn->piped += bytesSpliced;
+    conn->lastRead = loop.nowTick;
+    countStat(loop.stats->bytesIn, bytesSpliced);
+    if (CONFIG.framed) {
+        conn->frames.remaining -= bytesSpliced;
+    } else {
+        skipSpliced(conn->parser, peeked, bytesSpliced);
+    }
+    scheduleTimeout(loop, conn);
+    flushPending(loop, conn);
+    return true;
+}
+
+// **************************************************************************************
+// * handleReadable()
+// * - Reads one chunk from the client and either echoes it or acts on the command in it.
+// **************************************************************************************
+static void handleReadable(EventLoop &loop, Connection *conn) {
+    // The event may have been reported before reading was paused
+    if (conn->readPaused) {
+        return;
+    }
+    if (CONFIG.zeroCopy && spliceReadable(loop, conn)) {
+        return;
+    }
+
+    char buffer[kReadChunk];
+    ssize_t bytesRead = read(conn->fd, buffer, sizeof(buffer));
+
+    if (bytesRead == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        cerr << "Error reading from socket" << endl;
+        countStat(loop.stats->readErrors);
+        closeConnection(loop, conn);
+        return;
+    }
+
+    // If no bytes are read then the client has closed the connection
+    if (bytesRead == 0) {
+        DEBUG << "Client on " << conn->fd << " closed the connection" << ENDL;
+        beginClose(loop, conn);
+        return;
+    }
+
+    conn->lastRead = loop.nowTick;
+    countStat(loop.stats->bytesIn, bytesRead);
+    if (loop.turnaround == NULL) {
+        handleInput(loop, conn, buffer, bytesRead);
+    } else {
+        uint64_t readTime = monotonicNanos();
+        handleInput(loop, conn, buffer, bytesRead);
+        recordLatency(*loop.turnaround, monotonicNanos() - readTime);
+    }
+    // A line or frame left unfinished has until the read timeout to be completed
+    if (conn->fd != -1) {
+        scheduleTimeout(loop, conn);
+    }
+}
+
+// **************************************************************************************
+// * acceptConnections()
+// * - Accepts every connection waiting in the listen queue and registers it with epoll.
+// **************************************************************************************
+static void acceptConnections(EventLoop &loop) {
+    while (true) {
+        int connFd = accept4(loop.listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connFd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        DEBUG << "We have received a connection on " << connFd << ENDL;
+        if (CONFIG.busyPoll) {
+            setBusyPoll(connFd);
+        }
+
+        Connection *conn = new Connection();
+        conn->fd = connFd;
+        conn->closing = false;
+        initParser(conn->parser);
+        initFrameParser(conn->frames);
+        conn->pipeFds[0] = conn->pipeFds[1] = -1;
+        conn->pipeSize = 0;
+        conn->piped = 0;
+        initOutputBuffer(conn->output, &loop.pool);
+        conn->readPaused = false;
+        conn->interest = EPOLLIN;
+        initTimer(conn->timer, conn);
+        conn->lastRead = loop.nowTick;
+        conn->lastWrite = loop.nowTick;
+        conn->flushQueued = false;
+
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, connFd, &event) == -1) {
+            perror("epoll_ctl");
+            close(connFd);
+            delete conn;
+            continue;
+        }
+
+        if ((size_t)connFd >= loop.connections.size()) {
+            loop.connections.resize(connFd + 1, NULL);
+        }
+        loop.connections[connFd] = conn;
+        loop.activeConnections++;
+        countStat(loop.stats->accepted);
+        scheduleTimeout(loop, conn);
+    }
+}
+
+// **************************************************************************************
+// * expireConnection()
+// * - Called by the timing wheel. Closes the connection if it really has timed out, and
+// *   otherwise re-arms the timer for the deadline its latest progress earned it.
+// **************************************************************************************
+static void expireConnection(EventLoop &loop, Connection *conn) {
+    uint64_t deadline = timeoutDeadline(conn->lastRead, conn->lastWrite, hasOutput(conn),
+                                        inputUnfinished(conn->parser, conn->frames));
+    if (deadline == 0) {
+        return;
+    }
+    if (deadline > loop.nowTick) {
+        armTimer(loop.timers, conn->timer, deadline);
+        return;
+    }
+    DEBUG << "Connection on " << conn->fd << " timed out" << ENDL;
+    countStat(loop.stats->timeouts);
+    closeConnection(loop, conn);
+}
+
+// **************************************************************************************
+// * beginDrain()
+// * - Called once after a QUIT. Stops accepting, closes idle connections and lets the
+// *   rest finish writing what they already owe their clients.
+// **************************************************************************************
+static void beginDrain(EventLoop &loop) {
+    loop.draining = true;
+    epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, loop.listenFd, NULL);
+
+    for (size_t fd = 0; fd < loop.connections.size(); fd++) {
+        Connection *conn = loop.connections[fd];
+        if (conn != NULL && !conn->closing) {
+            beginClose(loop, conn);
+        }
+    }
+}
+
+// **************************************************************************************
+// * addToEpoll()
+// * - Registers one of the loop's own descriptors for EPOLLIN. The pointer stored with it
+// *   is how the loop tells the descriptor apart from a connection.
+// **************************************************************************************
+static bool addToEpoll(EventLoop &loop, int fd, void *tag) {
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = tag;
+    if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+// **************************************************************************************
+// * initEventLoop()
+// * - Creates the epoll instance and wake-up eventfd for one loop.
+// **************************************************************************************
+static bool initEventLoop(EventLoop &loop, int id, int listenFd) {
+    loop.id = id;
+    loop.inbox = createInbox();
+    loop.stats = &workerStats(id);
+    loop.listenFd = listenFd;
+    loop.draining = false;
+    loop.activeConnections = 0;
+    loop.epollFd = -1;
+    loop.wakeFd = -1;
+    initTimingWheel(loop.timers, kTimerSlots);
+    loop.nowTick = loop.timers.currentTick;
+    initBufferPool(loop.pool, CONFIG.poolBufferSize, CONFIG.poolSpareSlabs, loop.stats);
+    loop.turnaround = NULL;
+    if (CONFIG.busyPoll) {
+        loop.turnaround = new LatencyHistogram;
+        resetHistogram(*loop.turnaround);
+        setBusyPoll(listenFd);
+    }
+
+    if (!setNonBlocking(listenFd)) {
+        perror("fcntl");
+        return false;
+    }
+
+    loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epollFd == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+    DEBUG << "Loop " << id << " calling epoll_create1() assigned file descriptor " << loop.epollFd << ENDL;
+
+    loop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop.wakeFd == -1) {
+        perror("eventfd");
+        return false;
+    }
+
+    return addToEpoll(loop, listenFd, &loop.listenFd) && addToEpoll(loop, loop.wakeFd, &loop.wakeFd);
+}
+
+// **************************************************************************************
+// * runEventLoop()
+// * - Serves clients of one listening socket using non-blocking sockets and epoll.
+// * - Returns once any client has sent QUIT and this loop's connections have drained.
+// **************************************************************************************
+static void runEventLoop(EventLoop &loop) {
+    if (CONFIG.busyPoll) {
+        pinToCore((CONFIG.firstCore + loop.id) % sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    struct epoll_event events[kMaxEvents];
+    auto expire = [&](void *owner) { expireConnection(loop, (Connection *)owner); };
+    uint64_t lastEventTick = loop.nowTick;
+    while (!loop.draining || loop.activeConnections > 0) {
+        // Armed timers need the loop to wake up every tick. A busy-polling loop never
+        // sleeps at all.
+        int timeout = timerWaitMs(loop.timers);
+        if (loop.draining && (timeout == -1 || timeout > kDrainTimeoutMs)) {
+            timeout = kDrainTimeoutMs;
+        }
+        if (CONFIG.busyPoll) {
+            timeout = 0;
+        }
+        int eventCount = epoll_wait(loop.epollFd, events, kMaxEvents, timeout);
+        if (eventCount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        loop.nowTick = currentTimerTick();
+        if (eventCount > 0) {
+            lastEventTick = loop.nowTick;
+        }
+
+        // Nothing moved for the whole drain timeout, so give up on the stragglers
+        if (eventCount == 0 && loop.draining &&
+            loop.nowTick - lastEventTick >= (uint64_t)kDrainTimeoutMs / kTimerTickMs) {
+            cout << "Drain timed out, closing " << loop.activeConnections << " connections" << endl;
+            break;
+        }
+
+        for (int i = 0; i < eventCount; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &loop.listenFd) {
+                acceptConnections(loop);
+                continue;
+            }
+            if (tag == &loop.wakeFd) {
+                uint64_t count;
+                if (read(loop.wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    perror("read(eventfd)");
+                }
+                continue;
+            }
+
+            // A connection may have been closed earlier in this batch
+            Connection *conn = (Connection *)tag;
+            if (conn->fd == -1) {
+                continue;
+            }
+
+            // A closing connection has nothing left to read, so an error or hangup ends it
+            if (conn->closing && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                closeConnection(loop, conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!flushPending(loop, conn)) {
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                handleReadable(loop, conn);
+            }
+        }
+
+        deliverInbox(loop);
+        advanceWheel(loop.timers, loop.nowTick, expire);
+        if (!loop.draining && quitRequested.load(memory_order_relaxed)) {
+            beginDrain(loop);
+        }
+        releaseClosed(loop);
+    }
+
+    // Anything still open at this point is dropped
+    for (size_t fd = 0; fd < loop.connections.size(); fd++) {
+        if (loop.connections[fd] != NULL) {
+            closeConnection(loop, loop.connections[fd]);
+        }
+    }
+    releaseClosed(loop);
+}
+
+// **************************************************************************************
+// * runEventLoops()
+// * - Starts one event loop per listening socket, the first on the calling thread and
+// *   the rest on threads of their own, and waits for all of them to finish.
+// * - Returns false if a loop couldn't be set up.
+// **************************************************************************************
+bool runEventLoops(const vector<int> &listenFds) {
+    bool setupOk = true;
+    for (size_t i = 0; i < listenFds.size() && setupOk; i++) {
+        EventLoop *loop = new EventLoop();
+        eventLoops.push_back(loop);
+        setupOk = initEventLoop(*loop, i, listenFds[i]);
+    }
+
+    if (setupOk) {
+        vector<thread> workers;
+        for (size_t i = 1; i < eventLoops.size(); i++) {
+            workers.push_back(thread(runEventLoop, ref(*eventLoops[i])));
+        }
+        DEBUG << "Started " << eventLoops.size() << " event loops" << ENDL;
+
+        runEventLoop(*eventLoops[0]);
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+
+        if (CONFIG.busyPoll) {
+            LatencyHistogram turnaround;
+            resetHistogram(turnaround);
+            for (size_t i = 0; i < eventLoops.size(); i++) {
+                mergeHistogram(turnaround, *eventLoops[i]->turnaround);
+            }
+            reportTurnaround(turnaround);
+        }
+    }
+
+    for (size_t i = 0; i < eventLoops.size(); i++) {
+        if (eventLoops[i]->epollFd != -1) {
+            close(eventLoops[i]->epollFd);
+        }
+        if (eventLoops[i]->wakeFd != -1) {
+            close(eventLoops[i]->wakeFd);
+        }
+        releaseTimingWheel(eventLoops[i]->timers);
+        releaseBufferPool(eventLoops[i]->pool);
+        delete eventLoops[i]->turnaround;
+        if (eventLoops[i]->inbox != NULL) {
+            // Messages published after this loop stopped
+            MessageHandle *handle = takeMessages(*eventLoops[i]->inbox);
+            while (handle != NULL) {
+                MessageHandle *next = handle->next;
+                releaseHandle(handle);
+                handle = next;
+            }
+            destroyInbox(eventLoops[i]->inbox);
+        }
+        for (size_t p = 0; p < eventLoops[i]->sparePipes.size(); p++) {
+            close(eventLoops[i]->sparePipes[p].fds[0]);
+            close(eventLoops[i]->sparePipes[p].fds[1]);
+        }
+        delete eventLoops[i];
+    }
+    eventLoops.clear();
+    return setupOk;
+}
@@ -0,0 +1,177 @@
+#ifndef FRAME_PARSER_H
+#define FRAME_PARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "command_parser.h"
+
+// ********************************************************
+// * Incremental parser for the binary framing mode (-f).
+// *
+// * Every frame is a kFrameHeaderSize byte header, an
+// * opcode byte and a 32 bit payload length in network
+// * byte order, followed by that many payload bytes. A
+// * DATA frame, or one with an opcode the server doesn't
+// * know, is echoed whole. The payload is passed on as it
+// * arrives without being looked at, so a frame of any
+// * size streams straight through. CLOSE, QUIT and STATS
+// * frames are commands; their payload, if any, is dropped.
+// * Only a header split over two reads is ever held back.
+// ********************************************************
+static const size_t kFrameHeaderSize = 5;
+
+enum FrameOpcode {
+    FRAME_DATA = 0,
+    FRAME_CLOSE = 1,
+    FRAME_QUIT = 2,
+    FRAME_STATS = 3
+};
+
+struct FrameParser {
+    // Start of the next header from earlier reads
+    unsigned char header[kFrameHeaderSize];
+    size_t headerLength;
+    // Payload bytes of the current frame still to come
+    uint32_t remaining;
+    // What the current frame is, if it is a command
+    Command command;
+};
+
+inline void initFrameParser(FrameParser &parser) {
+    parser.headerLength = 0;
+    parser.remaining = 0;
+    parser.command = CMD_NONE;
+}
+
+inline Command frameCommand(unsigned char opcode) {
+    switch (opcode) {
+    case FRAME_CLOSE:
+        return CMD_CLOSE;
+    case FRAME_QUIT:
+        return CMD_QUIT;
+    case FRAME_STATS:
+        return CMD_STATS;
+    default:
+        return CMD_NONE;
+    }
+}
+
+// ***********************************************************
+// ** A complete frame, header and all, for replies the
+// ** server makes up itself.
+// ***********************************************************
+inline std::string makeFrame(FrameOpcode opcode, const std::string &payload) {
+    uint32_t length = payload.size();
+    std::string frame(kFrameHeaderSize, '\0');
+    frame[0] = opcode;
+    frame[1] = length >> 24;
+    frame[2] = length >> 16;
+    frame[3] = length >> 8;
+    frame[4] = length;
+    return frame + payload;
+}
+
+// ***********************************************************
+// ** True while the parser is inside the payload of a frame
+// ** that is being echoed, so the next bytes can be passed
+// ** on without going through parseFrames().
+// ***********************************************************
+inline bool inDataPayload(const FrameParser &parser) {
+    return parser.remaining > 0 && parser.command == CMD_NONE;
+}
+
+// ***********************************************************
+// ** True while the client has sent part of a frame but not
+// ** all of it.
+// ***********************************************************
+inline bool midFrame(const FrameParser &parser) {
+    return parser.headerLength > 0 || parser.remaining > 0;
+}
+
+// **************************************************************************************
+// * parseFrames()
+// * - Feeds the next bytes from the client to the parser. Works like parseInput(): bytes
+// *   to echo go to echo(const char *data, size_t length) in order, and it stops after
+// *   the first complete command frame and returns how many input bytes it used.
+// * - Runs of whole frames within one input are echoed with one call.
+// **************************************************************************************
+template <typename Echo>
+size_t parseFrames(FrameParser &parser, const char *data, size_t length, Command &command, Echo echo) {
+    command = CMD_NONE;
+    size_t position = 0;
+    // Start of the bytes from this input not yet echoed or dropped
+    size_t echoStart = 0;
+    size_t echoEnd = length;
+
+    while (position < length) {
+        if (parser.remaining > 0) {
+            size_t count = parser.remaining < length - position ? parser.remaining : length - position;
+            if (parser.command != CMD_NONE) {
+                // A command's payload is dropped
+                if (position > echoStart) {
+                    echo(data + echoStart, position - echoStart);
+                }
+                echoStart = position + count;
+            }
+            position += count;
+            parser.remaining -= count;
+            if (parser.remaining == 0 && parser.command != CMD_NONE) {
+                command = parser.command;
+                parser.command = CMD_NONE;
+                return position;
+            }
+            continue;
+        }
+
+        // The next header, which may have started in an earlier read
+        size_t headerStart = position;
+        size_t count = kFrameHeaderSize - parser.headerLength;
+        if (count > length - position) {
+            count = length - position;
+        }
+        memcpy(parser.header + parser.headerLength, data + position, count);
+        parser.headerLength += count;
+        position += count;
+        if (parser.headerLength < kFrameHeaderSize) {
+            // Held back until the rest of it arrives
+            echoEnd = headerStart;
+            break;
+        }
+
+        size_t heldLength = kFrameHeaderSize - count;
+        parser.headerLength = 0;
+        uint32_t payloadLength = ((uint32_t)parser.header[1] << 24) | ((uint32_t)parser.header[2] << 16) |
+                                 ((uint32_t)parser.header[3] << 8) | (uint32_t)parser.header[4];
+        Command found = frameCommand(parser.header[0]);
+        if (found == CMD_NONE) {
+            // Bytes held from an earlier read go out first; a header split over reads
+            // starts this input, so nothing from it can be ahead of them
+            if (heldLength > 0) {
+                echo((const char *)parser.header, heldLength);
+            }
+            parser.remaining = payloadLength;
+            continue;
+        }
+
+        // A command frame is never echoed
+        if (headerStart > echoStart) {
+            echo(data + echoStart, headerStart - echoStart);
+        }
+        echoStart = position;
+        if (payloadLength == 0) {
+            command = found;
+            return position;
+        }
+        parser.remaining = payloadLength;
+        parser.command = found;
+    }
+
+    if (echoEnd > echoStart) {
+        echo(data + echoStart, echoEnd - echoStart);
+    }
+    return length;
+}
+
+#endif
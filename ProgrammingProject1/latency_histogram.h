@@ -0,0 +1,100 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+// ********************************************************
+// * Log-linear latency histogram in nanoseconds. Values
+// * under 64 get a bucket each; above that every power of
+// * two is split into 32 buckets, so any reported value is
+// * within about 3% of the real one. Recording is a few
+// * shifts and an increment, and two histograms merge by
+// * adding their buckets.
+// ********************************************************
+static const int kLinearBuckets = 64;
+static const int kSubBucketBits = 5;
+static const int kSubBuckets = 1 << kSubBucketBits;
+static const int kHistogramBuckets = kLinearBuckets + (64 - 6) * kSubBuckets;
+
+struct LatencyHistogram {
+    uint64_t counts[kHistogramBuckets];
+    uint64_t total;
+    uint64_t max;
+};
+
+inline void resetHistogram(LatencyHistogram &histogram) {
+    memset(&histogram, 0, sizeof(histogram));
+}
+
+inline int bucketFor(uint64_t value) {
+    if (value < (uint64_t)kLinearBuckets) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1));
+    return kLinearBuckets + (exponent - 6) * kSubBuckets + sub;
+}
+
+// ***********************************************************
+// ** Largest value that lands in the bucket, so percentiles
+// ** err on the slow side.
+// ***********************************************************
+inline uint64_t bucketLimit(int bucket) {
+    if (bucket < kLinearBuckets) {
+        return bucket;
+    }
+    int exponent = (bucket - kLinearBuckets) / kSubBuckets + 6;
+    uint64_t sub = (bucket - kLinearBuckets) % kSubBuckets;
+    uint64_t width = 1ULL << (exponent - kSubBucketBits);
+    return (1ULL << exponent) + (sub + 1) * width - 1;
+}
+
+inline void recordLatency(LatencyHistogram &histogram, uint64_t nanoseconds) {
+    histogram.counts[bucketFor(nanoseconds)]++;
+    histogram.total++;
+    if (nanoseconds > histogram.max) {
+        histogram.max = nanoseconds;
+    }
+}
+
+inline void mergeHistogram(LatencyHistogram &into, const LatencyHistogram &from) {
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        into.counts[i] += from.counts[i];
+    }
+    into.total += from.total;
+    if (from.max > into.max) {
+        into.max = from.max;
+    }
+}
+
+// ***********************************************************
+// ** Value at or below which `fraction` of the samples fall.
+// ***********************************************************
+inline uint64_t latencyPercentile(const LatencyHistogram &histogram, double fraction) {
+    if (histogram.total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(fraction * histogram.total);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        seen += histogram.counts[i];
+        if (seen >= target) {
+            uint64_t limit = bucketLimit(i);
+            return limit < histogram.max ? limit : histogram.max;
+        }
+    }
+    return histogram.max;
+}
+
+inline uint64_t monotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif
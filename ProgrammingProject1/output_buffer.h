@@ -0,0 +1,243 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <cstddef>
+#include <cstring>
+#include <sys/uio.h>
+#include <cstdint>
+#include <vector>
+#include "buffer_pool.h"
+#include "pubsub.h"
+
+// ********************************************************
+// * Per-connection queue of echoed bytes the socket
+// * wouldn't take yet, kept in a chain of buffers borrowed
+// * from the worker's BufferPool. Bytes are read from the
+// * first buffer at headOffset and added to the last one
+// * at tailOffset. A buffer goes back to the pool as soon
+// * as it has been written out, so a connection that keeps
+// * up with its client never holds one.
+// *
+// * Published messages are queued by reference instead of
+// * copied in. Each remembers how many of the buffer's own
+// * bytes had been appended when it was queued, and goes
+// * out once exactly that many have been written.
+// ********************************************************
+static const int kMaxOutputSpans = 16;
+// Queued references kept room for once the queue empties
+static const size_t kKeptShared = 64;
+
+struct SharedOutput {
+    MessageHandle *handle;
+    // Own bytes appended before this message
+    uint64_t at;
+    // Bytes of the message already written
+    size_t offset;
+};
+
+struct OutputBuffer {
+    BufferPool *pool;
+    PoolBuffer *head;
+    PoolBuffer *tail;
+    size_t headOffset;
+    size_t tailOffset;
+    // Every byte queued, own and shared
+    size_t length;
+    // Own bytes appended and written since the buffer was set up
+    uint64_t ownAppended;
+    uint64_t ownWritten;
+    std::vector<SharedOutput> shared;
+    size_t sharedHead;
+};
+
+inline void initOutputBuffer(OutputBuffer &buffer, BufferPool *pool) {
+    buffer.pool = pool;
+    buffer.head = NULL;
+    buffer.tail = NULL;
+    buffer.headOffset = 0;
+    buffer.tailOffset = 0;
+    buffer.length = 0;
+    buffer.ownAppended = 0;
+    buffer.ownWritten = 0;
+    buffer.sharedHead = 0;
+}
+
+inline size_t bufferedBytes(const OutputBuffer &buffer) {
+    return buffer.length;
+}
+
+inline void releaseOutputBuffer(OutputBuffer &buffer) {
+    while (buffer.head != NULL) {
+        PoolBuffer *next = buffer.head->next;
+        returnBuffer(*buffer.pool, buffer.head);
+        buffer.head = next;
+    }
+    buffer.tail = NULL;
+    buffer.headOffset = 0;
+    buffer.tailOffset = 0;
+    buffer.length = 0;
+    buffer.ownWritten = buffer.ownAppended;
+
+    for (size_t i = buffer.sharedHead; i < buffer.shared.size(); i++) {
+        releaseHandle(buffer.shared[i].handle);
+    }
+    if (buffer.shared.capacity() > kKeptShared) {
+        std::vector<SharedOutput>().swap(buffer.shared);
+    } else {
+        buffer.shared.clear();
+    }
+    buffer.sharedHead = 0;
+}
+
+// ***********************************************************
+// ** Copies bytes in behind what is already queued, borrowing
+// ** more buffers as the last one fills up.
+// ***********************************************************
+inline void appendOutput(OutputBuffer &buffer, const char *bytes, size_t length) {
+    size_t bufferSize = buffer.pool->bufferSize;
+    while (length > 0) {
+        if (buffer.tail == NULL || buffer.tailOffset == bufferSize) {
+            PoolBuffer *next = borrowBuffer(*buffer.pool);
+            if (buffer.tail == NULL) {
+                buffer.head = next;
+                buffer.headOffset = 0;
+            } else {
+                buffer.tail->next = next;
+            }
+            buffer.tail = next;
+            buffer.tailOffset = 0;
+        }
+
+        size_t count = length < bufferSize - buffer.tailOffset ? length : bufferSize - buffer.tailOffset;
+        memcpy(bufferData(buffer.tail) + buffer.tailOffset, bytes, count);
+        buffer.tailOffset += count;
+        buffer.length += count;
+        buffer.ownAppended += count;
+        bytes += count;
+        length -= count;
+    }
+}
+
+// ***********************************************************
+// ** Queues a published message behind what is already
+// ** queued, holding a reference to it until it is written.
+// ** The first offset bytes of it have already gone out.
+// ***********************************************************
+inline void appendShared(OutputBuffer &buffer, MessageHandle *handle, size_t offset) {
+    holdHandle(handle);
+    SharedOutput output;
+    output.handle = handle;
+    output.at = buffer.ownAppended;
+    output.offset = offset;
+    buffer.shared.push_back(output);
+    buffer.length += handle->message->length - offset;
+}
+
+// ***********************************************************
+// ** How many own bytes can be written before the next
+// ** shared message is due.
+// ***********************************************************
+inline uint64_t ownBytesDue(const OutputBuffer &buffer, size_t sharedIndex) {
+    if (sharedIndex < buffer.shared.size()) {
+        return buffer.shared[sharedIndex].at;
+    }
+    return buffer.ownAppended;
+}
+
+// ***********************************************************
+// ** Fills in up to kMaxOutputSpans iovecs covering the
+// ** queued bytes, in order, for writev(). Returns how many
+// ** were used.
+// ***********************************************************
+inline int outputSpans(const OutputBuffer &buffer, struct iovec spans[kMaxOutputSpans]) {
+    int count = 0;
+    PoolBuffer *part = buffer.head;
+    size_t offset = buffer.headOffset;
+    uint64_t own = buffer.ownWritten;
+    size_t next = buffer.sharedHead;
+
+    while (count < kMaxOutputSpans) {
+        uint64_t ownEnd = ownBytesDue(buffer, next);
+        while (own < ownEnd && count < kMaxOutputSpans) {
+            size_t end = part == buffer.tail ? buffer.tailOffset : buffer.pool->bufferSize;
+            if (offset == end) {
+                part = part->next;
+                offset = 0;
+                continue;
+            }
+            size_t span = end - offset < ownEnd - own ? end - offset : ownEnd - own;
+            spans[count].iov_base = bufferData(part) + offset;
+            spans[count].iov_len = span;
+            count++;
+            offset += span;
+            own += span;
+        }
+        if (own < ownEnd || next == buffer.shared.size()) {
+            break;
+        }
+
+        const SharedOutput &output = buffer.shared[next];
+        spans[count].iov_base = (void *)(messageData(output.handle->message) + output.offset);
+        spans[count].iov_len = output.handle->message->length - output.offset;
+        count++;
+        next++;
+    }
+    return count;
+}
+
+// ***********************************************************
+// ** Drops bytes that have been written, giving each buffer
+// ** back to the pool once all of it is out.
+// ***********************************************************
+inline void consumeOutput(OutputBuffer &buffer, size_t length) {
+    buffer.length -= length;
+    if (buffer.length == 0) {
+        releaseOutputBuffer(buffer);
+        return;
+    }
+
+    size_t bufferSize = buffer.pool->bufferSize;
+    while (length > 0) {
+        uint64_t ownEnd = ownBytesDue(buffer, buffer.sharedHead);
+        if (buffer.ownWritten < ownEnd) {
+            size_t count = length < ownEnd - buffer.ownWritten ? length : ownEnd - buffer.ownWritten;
+            buffer.ownWritten += count;
+            length -= count;
+            count += buffer.headOffset;
+            while (count >= bufferSize) {
+                PoolBuffer *next = buffer.head->next;
+                returnBuffer(*buffer.pool, buffer.head);
+                buffer.head = next;
+                count -= bufferSize;
+            }
+            buffer.headOffset = count;
+            // Only shared messages are left, and the last buffer was full
+            if (buffer.head == NULL) {
+                buffer.tail = NULL;
+                buffer.tailOffset = 0;
+            }
+            continue;
+        }
+
+        SharedOutput &output = buffer.shared[buffer.sharedHead];
+        size_t left = output.handle->message->length - output.offset;
+        if (length < left) {
+            output.offset += length;
+            break;
+        }
+        length -= left;
+        releaseHandle(output.handle);
+        buffer.sharedHead++;
+    }
+
+    // Drop the references already written once they are most of the queue
+    if (buffer.sharedHead == buffer.shared.size()) {
+        buffer.shared.clear();
+        buffer.sharedHead = 0;
+    } else if (buffer.sharedHead >= kKeptShared && buffer.sharedHead * 2 >= buffer.shared.size()) {
+        buffer.shared.erase(buffer.shared.begin(), buffer.shared.begin() + buffer.sharedHead);
+        buffer.sharedHead = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include "pubsub.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+using namespace std;
+
+// **************************************************************************************
+// * createMessage()
+// * - Lays out the message, its handles, the channel name and the payload in one
+// *   allocation. Plain new only promises malloc()'s alignment before C++17, so the
+// *   cache line alignment of the handles is asked for directly.
+// **************************************************************************************
+SharedMessage *createMessage(const char *channel, size_t channelLength, const char *payload, size_t payloadLength,
+                             size_t handleCount) {
+    size_t size = sizeof(SharedMessage) + handleCount * sizeof(MessageHandle) + channelLength + payloadLength + 1;
+    void *storage = NULL;
+    if (posix_memalign(&storage, alignof(SharedMessage), size) != 0) {
+        cerr << "Could not allocate a published message" << endl;
+        exit(-1);
+    }
+
+    SharedMessage *message = new (storage) SharedMessage;
+    message->handlesInUse.store(handleCount, memory_order_relaxed);
+    message->handleCount = handleCount;
+    message->channelLength = channelLength;
+    message->length = payloadLength + 1;
+    for (size_t i = 0; i < handleCount; i++) {
+        MessageHandle *handle = new (messageHandle(message, i)) MessageHandle;
+        handle->next = NULL;
+        handle->message = message;
+        handle->refs = 1;
+    }
+
+    char *text = (char *)messageChannel(message);
+    memcpy(text, channel, channelLength);
+    memcpy(text + channelLength, payload, payloadLength);
+    text[channelLength + payloadLength] = '\n';
+    return message;
+}
+
+// **************************************************************************************
+// * releaseMessage()
+// * - Called once for each handle when its worker is done with it. The last one frees
+// *   the message; acq_rel makes every worker's reads of it happen before that.
+// **************************************************************************************
+void releaseMessage(SharedMessage *message) {
+    if (message->handlesInUse.fetch_sub(1, memory_order_acq_rel) == 1) {
+        message->~SharedMessage();
+        free(message);
+    }
+}
+
+Inbox *createInbox() {
+    void *storage = NULL;
+    if (posix_memalign(&storage, alignof(Inbox), sizeof(Inbox)) != 0) {
+        cerr << "Could not allocate an inbox" << endl;
+        exit(-1);
+    }
+    Inbox *inbox = new (storage) Inbox;
+    inbox->head.store(NULL, memory_order_relaxed);
+    return inbox;
+}
+
+void destroyInbox(Inbox *inbox) {
+    inbox->~Inbox();
+    free(inbox);
+}
+
+bool postMessage(Inbox &inbox, MessageHandle *handle) {
+    MessageHandle *head = inbox.head.load(memory_order_relaxed);
+    do {
+        handle->next = head;
+    } while (!inbox.head.compare_exchange_weak(head, handle, memory_order_release, memory_order_relaxed));
+    return head == NULL;
+}
+
+// **************************************************************************************
+// * takeMessages()
+// * - Empties the inbox in one exchange, so there is no ABA problem, then reverses the
+// *   stack to get the handles back in the order they were posted.
+// **************************************************************************************
+MessageHandle *takeMessages(Inbox &inbox) {
+    if (inbox.head.load(memory_order_relaxed) == NULL) {
+        return NULL;
+    }
+    MessageHandle *stack = inbox.head.exchange(NULL, memory_order_acquire);
+    MessageHandle *ordered = NULL;
+    while (stack != NULL) {
+        MessageHandle *next = stack->next;
+        stack->next = ordered;
+        ordered = stack;
+        stack = next;
+    }
+    return ordered;
+}
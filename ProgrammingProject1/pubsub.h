@@ -0,0 +1,94 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <atomic>
+#include <cstddef>
+
+// ********************************************************
+// * A message published to a channel, stored once and
+// * shared by every subscriber rather than copied to each.
+// *
+// * The message is allocated with one MessageHandle per
+// * worker. The publisher hands each worker its handle
+// * through that worker's Inbox, and the output queue of
+// * every subscriber on that worker points at the handle.
+// * Only its own worker ever touches a handle, so the
+// * handle counts those references without atomics; the
+// * message itself only counts the handles still in use.
+// * Fanning out to any number of subscribers costs each
+// * worker one atomic operation per message.
+// ********************************************************
+struct SharedMessage;
+
+struct alignas(64) MessageHandle {
+    // Next handle waiting in the same inbox
+    MessageHandle *next;
+    SharedMessage *message;
+    size_t refs;
+};
+
+// Followed in memory by its handles, then the channel name,
+// then the payload with a newline added
+struct alignas(64) SharedMessage {
+    std::atomic<size_t> handlesInUse;
+    size_t handleCount;
+    size_t channelLength;
+    size_t length;
+};
+
+// ********************************************************
+// * Handles posted to one worker. Any thread may post; only
+// * the owning worker takes them. It is a lock-free stack
+// * on a cache line of its own.
+// ********************************************************
+struct alignas(64) Inbox {
+    std::atomic<MessageHandle *> head;
+};
+
+inline MessageHandle *messageHandle(SharedMessage *message, size_t worker) {
+    return (MessageHandle *)(message + 1) + worker;
+}
+
+inline const char *messageChannel(SharedMessage *message) {
+    return (const char *)messageHandle(message, message->handleCount);
+}
+
+inline const char *messageData(SharedMessage *message) {
+    return messageChannel(message) + message->channelLength;
+}
+
+// ***********************************************************
+// ** Every handle starts out holding one reference, which its
+// ** worker gives up once it has queued the message for its
+// ** subscribers.
+// ***********************************************************
+SharedMessage *createMessage(const char *channel, size_t channelLength, const char *payload, size_t payloadLength,
+                             size_t handleCount);
+void releaseMessage(SharedMessage *message);
+
+inline void holdHandle(MessageHandle *handle) {
+    handle->refs++;
+}
+
+inline void releaseHandle(MessageHandle *handle) {
+    if (--handle->refs == 0) {
+        releaseMessage(handle->message);
+    }
+}
+
+Inbox *createInbox();
+void destroyInbox(Inbox *inbox);
+
+// ***********************************************************
+// ** Returns true if the inbox was empty, in which case its
+// ** worker may be asleep and needs waking.
+// ***********************************************************
+bool postMessage(Inbox &inbox, MessageHandle *handle);
+
+// ***********************************************************
+// ** Takes every handle waiting in the inbox, oldest first,
+// ** linked through next.
+// ***********************************************************
+MessageHandle *takeMessages(Inbox &inbox);
+
+#endif
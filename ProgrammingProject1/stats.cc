@@ -0,0 +1,119 @@
+#include "stats.h"
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+using namespace std;
+
+static WorkerStats *allWorkerStats = NULL;
+static int workerStatsCount = 0;
+static time_t startTime;
+
+void initWorkerStats(int workerCount) {
+    // Plain new only promises malloc()'s alignment before C++17, so the cache line
+    // alignment is asked for directly
+    void *storage = NULL;
+    if (posix_memalign(&storage, alignof(WorkerStats), workerCount * sizeof(WorkerStats)) != 0) {
+        cerr << "Could not allocate worker stats" << endl;
+        exit(-1);
+    }
+    allWorkerStats = (WorkerStats *)storage;
+    workerStatsCount = workerCount;
+    startTime = time(NULL);
+
+    for (int i = 0; i < workerCount; i++) {
+        WorkerStats &stats = *new (&allWorkerStats[i]) WorkerStats;
+        stats.accepted = 0;
+        stats.closed = 0;
+        stats.bytesIn = 0;
+        stats.bytesOut = 0;
+        stats.commands = 0;
+        stats.readErrors = 0;
+        stats.writeErrors = 0;
+        stats.timeouts = 0;
+        stats.packetsIn = 0;
+        stats.packetsOut = 0;
+        stats.published = 0;
+        stats.delivered = 0;
+        stats.dropped = 0;
+        stats.poolBuffersInUse = 0;
+        stats.poolHighWater = 0;
+        stats.poolBytes = 0;
+    }
+}
+
+WorkerStats &workerStats(int worker) {
+    return allWorkerStats[worker];
+}
+
+// **************************************************************************************
+// * statsSnapshot()
+// * - Reads every worker's counters without stopping them. Each counter is exact on its
+// *   own; the set as a whole may be a few operations apart between workers.
+// **************************************************************************************
+string statsSnapshot() {
+    uint64_t accepted = 0;
+    uint64_t active = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t commands = 0;
+    uint64_t readErrors = 0;
+    uint64_t writeErrors = 0;
+    uint64_t timeouts = 0;
+    uint64_t packetsIn = 0;
+    uint64_t packetsOut = 0;
+    uint64_t published = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t poolBuffersInUse = 0;
+    uint64_t poolHighWater = 0;
+    uint64_t poolBytes = 0;
+
+    for (int i = 0; i < workerStatsCount; i++) {
+        WorkerStats &stats = allWorkerStats[i];
+        // A connection accepted and closed between the two loads could make this
+        // worker's difference briefly negative
+        uint64_t workerClosed = stats.closed.load(memory_order_relaxed);
+        uint64_t workerAccepted = stats.accepted.load(memory_order_relaxed);
+        accepted += workerAccepted;
+        active += workerAccepted > workerClosed ? workerAccepted - workerClosed : 0;
+        bytesIn += stats.bytesIn.load(memory_order_relaxed);
+        bytesOut += stats.bytesOut.load(memory_order_relaxed);
+        commands += stats.commands.load(memory_order_relaxed);
+        readErrors += stats.readErrors.load(memory_order_relaxed);
+        writeErrors += stats.writeErrors.load(memory_order_relaxed);
+        timeouts += stats.timeouts.load(memory_order_relaxed);
+        packetsIn += stats.packetsIn.load(memory_order_relaxed);
+        packetsOut += stats.packetsOut.load(memory_order_relaxed);
+        published += stats.published.load(memory_order_relaxed);
+        delivered += stats.delivered.load(memory_order_relaxed);
+        dropped += stats.dropped.load(memory_order_relaxed);
+        poolBuffersInUse += stats.poolBuffersInUse.load(memory_order_relaxed);
+        // Each worker's own peak, so the sum is an upper bound on the peak overall
+        poolHighWater += stats.poolHighWater.load(memory_order_relaxed);
+        poolBytes += stats.poolBytes.load(memory_order_relaxed);
+    }
+
+    ostringstream line;
+    line << "STATS workers=" << workerStatsCount
+         << " uptime_sec=" << (time(NULL) - startTime)
+         << " accepted=" << accepted
+         << " active=" << active
+         << " bytes_in=" << bytesIn
+         << " bytes_out=" << bytesOut
+         << " commands=" << commands
+         << " read_errors=" << readErrors
+         << " write_errors=" << writeErrors
+         << " timeouts=" << timeouts
+         << " packets_in=" << packetsIn
+         << " packets_out=" << packetsOut
+         << " published=" << published
+         << " delivered=" << delivered
+         << " dropped=" << dropped
+         << " pool_in_use=" << poolBuffersInUse
+         << " pool_high_water=" << poolHighWater
+         << " pool_bytes=" << poolBytes << "\n";
+    return line.str();
+}
@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// ********************************************************
+// * Counters kept by one worker. Only the owning worker
+// * ever writes them, so an update is a relaxed load and
+// * store with no locked instruction, and each worker's
+// * counters sit on cache lines of their own so workers
+// * never bounce a line between them. Any thread may read
+// * them at any time for a snapshot.
+// ********************************************************
+struct alignas(64) WorkerStats {
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> closed;
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> commands;
+    std::atomic<uint64_t> readErrors;
+    std::atomic<uint64_t> writeErrors;
+    std::atomic<uint64_t> timeouts;
+    // Datagrams, in UDP mode
+    std::atomic<uint64_t> packetsIn;
+    std::atomic<uint64_t> packetsOut;
+    // PUBLISH commands, and copies of messages queued for or
+    // dropped at subscribers on this worker
+    std::atomic<uint64_t> published;
+    std::atomic<uint64_t> delivered;
+    std::atomic<uint64_t> dropped;
+    // Gauges for the worker's buffer pool, stored rather than added to
+    std::atomic<uint64_t> poolBuffersInUse;
+    std::atomic<uint64_t> poolHighWater;
+    std::atomic<uint64_t> poolBytes;
+};
+
+inline void countStat(std::atomic<uint64_t> &counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// ***********************************************************
+// ** Sets up one zeroed WorkerStats per worker. Called once
+// ** before any worker starts.
+// ***********************************************************
+void initWorkerStats(int workerCount);
+WorkerStats &workerStats(int worker);
+
+// ***********************************************************
+// ** One line summing every worker's counters, ending in
+// ** a newline, as sent back for the STATS command.
+// ***********************************************************
+std::string statsSnapshot();
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// ********************************************************
+// * Hashed timing wheel for connection timeouts.
+// *
+// * Time is counted in ticks. A timer due at tick T lives
+// * in slot T % slotCount, on an intrusive doubly linked
+// * list, so arming and cancelling are O(1) and need no
+// * allocation. Each tick the loop visits one slot and
+// * fires the timers in it that are due; timers further
+// * out than one turn of the wheel just stay where they
+// * are until a later turn comes round.
+// ********************************************************
+static const uint64_t kTimerTickMs = 100;
+
+struct TimerEntry {
+    TimerEntry *prev;
+    TimerEntry *next;
+    uint64_t expiresTick;
+    void *owner;
+};
+
+struct TimingWheel {
+    // One list head per slot; an empty slot points at itself
+    TimerEntry *slots;
+    size_t slotCount;
+    uint64_t currentTick;
+    size_t armed;
+};
+
+inline uint64_t currentTimerTick() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / kTimerTickMs;
+}
+
+inline void initTimer(TimerEntry &entry, void *owner) {
+    entry.prev = NULL;
+    entry.next = NULL;
+    entry.expiresTick = 0;
+    entry.owner = owner;
+}
+
+inline bool timerArmed(const TimerEntry &entry) {
+    return entry.next != NULL;
+}
+
+// ***********************************************************
+// ** slotCount must be a power of two.
+// ***********************************************************
+inline void initTimingWheel(TimingWheel &wheel, size_t slotCount) {
+    wheel.slots = new TimerEntry[slotCount];
+    wheel.slotCount = slotCount;
+    wheel.currentTick = currentTimerTick();
+    wheel.armed = 0;
+    for (size_t i = 0; i < slotCount; i++) {
+        wheel.slots[i].prev = &wheel.slots[i];
+        wheel.slots[i].next = &wheel.slots[i];
+    }
+}
+
+inline void releaseTimingWheel(TimingWheel &wheel) {
+    delete[] wheel.slots;
+    wheel.slots = NULL;
+}
+
+inline void linkTimer(TimerEntry &head, TimerEntry &entry) {
+    entry.prev = &head;
+    entry.next = head.next;
+    head.next->prev = &entry;
+    head.next = &entry;
+}
+
+inline void unlinkTimer(TimerEntry &entry) {
+    entry.prev->next = entry.next;
+    entry.next->prev = entry.prev;
+    entry.prev = NULL;
+    entry.next = NULL;
+}
+
+inline void cancelTimer(TimingWheel &wheel, TimerEntry &entry) {
+    if (timerArmed(entry)) {
+        unlinkTimer(entry);
+        wheel.armed--;
+    }
+}
+
+// ***********************************************************
+// ** (Re)arms a timer for the given tick. A tick that has
+// ** already gone by fires on the next one.
+// ***********************************************************
+inline void armTimer(TimingWheel &wheel, TimerEntry &entry, uint64_t expiresTick) {
+    cancelTimer(wheel, entry);
+    if (expiresTick <= wheel.currentTick) {
+        expiresTick = wheel.currentTick + 1;
+    }
+    entry.expiresTick = expiresTick;
+    linkTimer(wheel.slots[expiresTick & (wheel.slotCount - 1)], entry);
+    wheel.armed++;
+}
+
+// ***********************************************************
+// ** Milliseconds until the next tick is due, for the loop's
+// ** wait timeout, or -1 when nothing is armed.
+// ***********************************************************
+inline int timerWaitMs(const TimingWheel &wheel) {
+    return wheel.armed > 0 ? (int)kTimerTickMs : -1;
+}
+
+// **************************************************************************************
+// * advanceWheel()
+// * - Moves the wheel on to nowTick and calls expire(owner) for every timer that is due
+// *   by then, disarmed first. expire may arm or cancel any timer, including its own.
+// * - A wheel that fell more than a whole turn behind visits each slot only once.
+// **************************************************************************************
+template <typename Expire>
+void advanceWheel(TimingWheel &wheel, uint64_t nowTick, Expire expire) {
+    uint64_t startTick = wheel.currentTick;
+    if (nowTick <= startTick) {
+        return;
+    }
+    // Timers armed from expire() are due after nowTick at the earliest
+    wheel.currentTick = nowTick;
+
+    uint64_t steps = nowTick - startTick;
+    if (steps > wheel.slotCount) {
+        steps = wheel.slotCount;
+    }
+    for (uint64_t step = 1; step <= steps && wheel.armed > 0; step++) {
+        TimerEntry &slot = wheel.slots[(startTick + step) & (wheel.slotCount - 1)];
+        if (slot.next == &slot) {
+            continue;
+        }
+
+        // Take the whole slot aside so expire() can't change the list being walked
+        TimerEntry pending;
+        pending.next = slot.next;
+        pending.prev = slot.prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        slot.next = &slot;
+        slot.prev = &slot;
+
+        while (pending.next != &pending) {
+            TimerEntry &entry = *pending.next;
+            unlinkTimer(entry);
+            if (entry.expiresTick > nowTick) {
+                linkTimer(slot, entry);
+                continue;
+            }
+            wheel.armed--;
+            expire(entry.owner);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,375 @@
+#include "echo_s.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <iostream>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+using namespace std;
+
+// Datagrams taken per recvmmsg() call
+static const unsigned kBatch = 64;
+// Room for the largest UDP payload, or for a whole coalesced GRO batch
+static const size_t kDatagramSize = 65536;
+
+// ********************************************************
+// * State for one UDP worker. Like EventLoop, each one
+// * runs on its own thread with its own SO_REUSEPORT
+// * socket. A received batch is echoed with one
+// * sendmmsg() straight out of the receive buffers, so the
+// * replies array lines up with the receive side.
+// ********************************************************
+struct UdpLoop {
+    int id;
+    WorkerStats *stats;
+    int fd;
+    int epollFd;
+    int wakeFd;
+    bool groEnabled;
+
+    vector<char> buffers;
+    struct mmsghdr messages[kBatch];
+    struct iovec iovs[kBatch];
+    struct sockaddr_in peers[kBatch];
+    char control[kBatch][CMSG_SPACE(sizeof(int))];
+
+    // Replies waiting for the next sendmmsg()
+    unsigned replyCount;
+    struct mmsghdr replies[kBatch];
+    struct iovec replyIovs[kBatch];
+    char replyControl[kBatch][CMSG_SPACE(sizeof(uint16_t))];
+};
+
+// Every running loop, filled in before any thread starts and never changed after
+static vector<UdpLoop *> udpLoops;
+// Set by whichever loop sees a QUIT first
+static atomic<bool> quitRequested(false);
+
+// **************************************************************************************
+// * requestQuit()
+// * - Tells every loop, including the calling one, to stop.
+// **************************************************************************************
+static void requestQuit() {
+    if (quitRequested.exchange(true)) {
+        return;
+    }
+    for (size_t i = 0; i < udpLoops.size(); i++) {
+        uint64_t one = 1;
+        if (write(udpLoops[i]->wakeFd, &one, sizeof(one)) == -1) {
+            perror("write(eventfd)");
+        }
+    }
+}
+
+// **************************************************************************************
+// * datagramCommand()
+// * - A datagram is a command when it holds nothing but the command word, with or
+// *   without a line ending. Anything else is data.
+// **************************************************************************************
+static Command datagramCommand(const char *data, size_t length) {
+    if (length > 0 && data[length - 1] == '\n') {
+        length--;
+    }
+    if (length >= kMaxHeld) {
+        return CMD_NONE;
+    }
+    unsigned candidates = kAllCandidates;
+    for (size_t i = 0; i < length && candidates != 0; i++) {
+        candidates = matchByte(candidates, i, data[i]);
+    }
+    return completedCommand(candidates, length);
+}
+
+// **************************************************************************************
+// * flushReplies()
+// * - Sends every queued reply. The socket is blocking for sends, so sendmmsg() only
+// *   stops early on an error, and then the reply it failed on is dropped.
+// **************************************************************************************
+static void flushReplies(UdpLoop &loop) {
+    unsigned sent = 0;
+    while (sent < loop.replyCount) {
+        int count = sendmmsg(loop.fd, loop.replies + sent, loop.replyCount - sent, 0);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DEBUG << "sendmmsg failed: " << strerror(errno) << ENDL;
+            countStat(loop.stats->writeErrors);
+            sent++;
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            struct mmsghdr &reply = loop.replies[sent + i];
+            size_t length = reply.msg_hdr.msg_iov->iov_len;
+            size_t segments = 1;
+            if (reply.msg_hdr.msg_controllen > 0) {
+                uint16_t segmentSize;
+                memcpy(&segmentSize, CMSG_DATA(CMSG_FIRSTHDR(&reply.msg_hdr)), sizeof(segmentSize));
+                segments = (length + segmentSize - 1) / segmentSize;
+            }
+            countStat(loop.stats->bytesOut, length);
+            countStat(loop.stats->packetsOut, segments);
+        }
+        sent += count;
+    }
+    loop.replyCount = 0;
+}
+
+// **************************************************************************************
+// * queueReply()
+// * - Queues bytes to go back to a peer. With segmentSize set, one send carries several
+// *   datagrams of that size, which the kernel (or the NIC) splits apart again.
+// **************************************************************************************
+static void queueReply(UdpLoop &loop, struct sockaddr_in *peer, char *data, size_t length, size_t segmentSize) {
+    if (loop.replyCount == kBatch) {
+        flushReplies(loop);
+    }
+
+    unsigned index = loop.replyCount++;
+    struct mmsghdr &reply = loop.replies[index];
+    bzero(&reply, sizeof(reply));
+    loop.replyIovs[index].iov_base = data;
+    loop.replyIovs[index].iov_len = length;
+    reply.msg_hdr.msg_name = peer;
+    reply.msg_hdr.msg_namelen = sizeof(*peer);
+    reply.msg_hdr.msg_iov = &loop.replyIovs[index];
+    reply.msg_hdr.msg_iovlen = 1;
+
+    if (segmentSize > 0 && segmentSize < length) {
+        reply.msg_hdr.msg_control = loop.replyControl[index];
+        reply.msg_hdr.msg_controllen = sizeof(loop.replyControl[index]);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&reply.msg_hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t size = segmentSize;
+        memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+    }
+}
+
+// **************************************************************************************
+// * handleDatagram()
+// * - Echoes one datagram back to its sender, or acts on it if it is a command. STATS
+// *   is answered right away, after the replies queued ahead of it.
+// **************************************************************************************
+static void handleDatagram(UdpLoop &loop, struct sockaddr_in *peer, char *data, size_t length) {
+    countStat(loop.stats->packetsIn);
+    Command command = datagramCommand(data, length);
+    if (command == CMD_NONE || command == CMD_CLOSE) {
+        // There is no connection for CLOSE to close, so it is echoed like any data
+        queueReply(loop, peer, data, length, 0);
+        return;
+    }
+
+    countStat(loop.stats->commands);
+    if (command == CMD_QUIT) {
+        cout << "Client sent QUIT" << endl;
+        requestQuit();
+        return;
+    }
+
+    flushReplies(loop);
+    string snapshot = statsSnapshot();
+    if (sendto(loop.fd, snapshot.data(), snapshot.size(), 0, (struct sockaddr *)peer, sizeof(*peer)) == -1) {
+        countStat(loop.stats->writeErrors);
+        return;
+    }
+    countStat(loop.stats->bytesOut, snapshot.size());
+    countStat(loop.stats->packetsOut);
+}
+
+// **************************************************************************************
+// * receiveBatch()
+// * - Takes up to kBatch messages with one recvmmsg() and queues the replies.
+// * - With GRO a message can hold several datagrams of segmentSize bytes from one
+// *   sender, the last one possibly shorter. Those that are too big to be a command go
+// *   straight back as one segmented send; small ones are looked at one by one.
+// * - Returns false once the socket has nothing more to read.
+// **************************************************************************************
+static bool receiveBatch(UdpLoop &loop) {
+    for (unsigned i = 0; i < kBatch; i++) {
+        struct msghdr &header = loop.messages[i].msg_hdr;
+        header.msg_name = &loop.peers[i];
+        header.msg_namelen = sizeof(loop.peers[i]);
+        header.msg_iov = &loop.iovs[i];
+        header.msg_iovlen = 1;
+        header.msg_control = loop.groEnabled ? loop.control[i] : NULL;
+        header.msg_controllen = loop.groEnabled ? sizeof(loop.control[i]) : 0;
+        header.msg_flags = 0;
+    }
+
+    int count = recvmmsg(loop.fd, loop.messages, kBatch, MSG_DONTWAIT, NULL);
+    if (count == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvmmsg");
+            countStat(loop.stats->readErrors);
+        }
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct msghdr &header = loop.messages[i].msg_hdr;
+        char *data = (char *)loop.iovs[i].iov_base;
+        size_t length = loop.messages[i].msg_len;
+        countStat(loop.stats->bytesIn, length);
+
+        size_t segmentSize = length;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                segmentSize = size;
+            }
+        }
+
+        if (segmentSize > 0 && segmentSize < length) {
+            DEBUG << "Coalesced " << length << " bytes in " << segmentSize << " byte datagrams" << ENDL;
+        }
+        if (segmentSize == 0 || segmentSize >= length) {
+            handleDatagram(loop, &loop.peers[i], data, length);
+        } else if (segmentSize >= kMaxHeld) {
+            // Only the short last datagram could still be a command
+            size_t lastStart = (length - 1) / segmentSize * segmentSize;
+            bool lastIsCommand = datagramCommand(data + lastStart, length - lastStart) != CMD_NONE;
+            size_t segmentedLength = lastIsCommand ? lastStart : length;
+            countStat(loop.stats->packetsIn, (segmentedLength + segmentSize - 1) / segmentSize);
+            queueReply(loop, &loop.peers[i], data, segmentedLength, segmentSize);
+            if (lastIsCommand) {
+                handleDatagram(loop, &loop.peers[i], data + lastStart, length - lastStart);
+            }
+        } else {
+            for (size_t offset = 0; offset < length; offset += segmentSize) {
+                size_t size = length - offset < segmentSize ? length - offset : segmentSize;
+                handleDatagram(loop, &loop.peers[i], data + offset, size);
+            }
+        }
+    }
+
+    // The replies point into the receive buffers, so they go out before the next batch
+    flushReplies(loop);
+    return count == (int)kBatch;
+}
+
+// **************************************************************************************
+// * initUdpLoop()
+// * - Sets up the buffers, epoll instance and wake-up eventfd for one worker, and turns
+// *   on GRO when asked for.
+// **************************************************************************************
+static bool initUdpLoop(UdpLoop &loop, int id, int fd) {
+    loop.id = id;
+    loop.stats = &workerStats(id);
+    loop.fd = fd;
+    loop.epollFd = -1;
+    loop.wakeFd = -1;
+    loop.groEnabled = false;
+    loop.replyCount = 0;
+
+    loop.buffers.resize(kBatch * kDatagramSize);
+    for (unsigned i = 0; i < kBatch; i++) {
+        loop.iovs[i].iov_base = &loop.buffers[i * kDatagramSize];
+        loop.iovs[i].iov_len = kDatagramSize;
+    }
+
+    if (CONFIG.segmentOffload) {
+        int enable = 1;
+        if (setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == -1) {
+            perror("setsockopt(UDP_GRO)");
+        } else {
+            loop.groEnabled = true;
+        }
+    }
+
+    loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epollFd == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+    loop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop.wakeFd == -1) {
+        perror("eventfd");
+        return false;
+    }
+
+    int fds[2] = { fd, loop.wakeFd };
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fds[i];
+        if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+            perror("epoll_ctl");
+            return false;
+        }
+    }
+    return true;
+}
+
+// **************************************************************************************
+// * runUdpLoop()
+// * - Echoes datagrams until some client sends QUIT. A readable socket is drained a batch
+// *   at a time before going back to epoll_wait().
+// **************************************************************************************
+static void runUdpLoop(UdpLoop &loop) {
+    DEBUG << "UDP loop " << loop.id << " serving descriptor " << loop.fd << ENDL;
+    while (!quitRequested.load(memory_order_relaxed)) {
+        struct epoll_event events[2];
+        int eventCount = epoll_wait(loop.epollFd, events, 2, -1);
+        if (eventCount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < eventCount; i++) {
+            bool more = events[i].data.fd == loop.fd;
+            while (more && !quitRequested.load(memory_order_relaxed)) {
+                more = receiveBatch(loop);
+            }
+        }
+    }
+}
+
+// **************************************************************************************
+// * runUdpLoops()
+// * - Starts one UDP worker per socket, the first on the calling thread, and waits for
+// *   all of them to finish.
+// * - Returns false if a worker couldn't be set up.
+// **************************************************************************************
+bool runUdpLoops(const vector<int> &udpFds) {
+    bool setupOk = true;
+    for (size_t i = 0; i < udpFds.size() && setupOk; i++) {
+        UdpLoop *loop = new UdpLoop();
+        udpLoops.push_back(loop);
+        setupOk = initUdpLoop(*loop, i, udpFds[i]);
+    }
+
+    if (setupOk) {
+        vector<thread> workers;
+        for (size_t i = 1; i < udpLoops.size(); i++) {
+            workers.push_back(thread(runUdpLoop, ref(*udpLoops[i])));
+        }
+        DEBUG << "Started " << udpLoops.size() << " UDP loops" << ENDL;
+
+        runUdpLoop(*udpLoops[0]);
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    for (size_t i = 0; i < udpLoops.size(); i++) {
+        if (udpLoops[i]->epollFd != -1) {
+            close(udpLoops[i]->epollFd);
+        }
+        if (udpLoops[i]->wakeFd != -1) {
+            close(udpLoops[i]->wakeFd);
+        }
+        delete udpLoops[i];
+    }
+    udpLoops.clear();
+    return setupOk;
+}
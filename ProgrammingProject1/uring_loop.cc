@@ -0,0 +1,946 @@
+#include "echo_s.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+// Submission queue size; the completion queue is made larger since multishot
+// requests can post many completions for one submission
+static const unsigned kRingEntries = 1024;
+static const unsigned kCompletionEntries = 8192;
+// Provided buffers handed to the kernel for multishot recv
+static const unsigned kBufferCount = 512;
+static const unsigned kBufferSize = 4096;
+static const __u16 kBufferGroup = 0;
+// How long a QUIT waits for slow readers before closing them anyway
+static const long long kDrainTimeoutSec = 5;
+// Send list entries an idle connection may keep allocated
+static const size_t kKeptSends = 64;
+// Slots in each loop's timing wheel; one turn is kTimerSlots * kTimerTickMs
+static const size_t kTimerSlots = 1024;
+
+// The low bits of user_data say what kind of request completed. The rest is
+// the Connection (or loop) it belongs to.
+enum UringOp {
+    OP_ACCEPT = 1,
+    OP_WAKE = 2,
+    OP_RECV = 3,
+    OP_SEND = 4,
+    OP_CANCEL = 5,
+    OP_TIMEOUT = 6,
+    OP_TICK = 7
+};
+static const __u64 kOpMask = 7;
+
+// ********************************************************
+// * One run of bytes waiting to be sent back to a client.
+// * Usually it points into a provided buffer, and the last
+// * run taken from a buffer returns it to the kernel once
+// * sent. Bytes the parser held back from an earlier recv
+// * no longer have a buffer, so they travel in inlineData,
+// * or in ownedData when there are more than fit there (the
+// * held argument of a command line too long to be one).
+// * Replies the server makes up itself, like STATS, are in
+// * ownedData, which is freed once sent or dropped.
+// ********************************************************
+static const __u16 kInlineSend = 0xffff;
+static const __u16 kOwnedSend = 0xfffe;
+
+struct UringSend {
+    __u16 bufferId;
+    bool releasesBuffer;
+    __u32 offset;
+    __u32 length;
+    char inlineData[kMaxHeld];
+    char *ownedData;
+};
+
+// ********************************************************
+// * Per-connection state for the io_uring backend. The
+// * connection is freed once no request refers to it.
+// * queuedBytes counts everything queued or in flight;
+// * past the high watermark the multishot recv is
+// * cancelled and recvPaused keeps it from being re-armed
+// * until the client has read down to the low watermark.
+// * The timer works as in the epoll Connection.
+// ********************************************************
+struct UringConnection {
+    int fd;
+    CommandParser parser;
+    FrameParser frames;
+    size_t queuedBytes;
+    bool recvPaused;
+    bool recvArmed;
+    bool closing;
+    unsigned sendsInFlight;
+    vector<UringSend> queued;
+    vector<UringSend> inFlight;
+    TimerEntry timer;
+    uint64_t lastRead;
+    uint64_t lastWrite;
+};
+
+// ********************************************************
+// * One ring and everything mapped for it. Like EventLoop,
+// * each UringLoop belongs to a single thread.
+// ********************************************************
+struct UringLoop {
+    int id;
+    WorkerStats *stats;
+    int ringFd;
+    int listenFd;
+    int wakeFd;
+    __u64 wakeValue;
+
+    // Submission queue
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail;
+    unsigned pendingSubmits;
+
+    // Completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    // Mappings to release at the end
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    // Provided buffer ring
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    char *buffers;
+    __u16 bufTail;
+    bool buffersReturned;
+
+    bool acceptArmed;
+    bool draining;
+    size_t activeConnections;
+    vector<UringConnection *> connections;
+    vector<UringConnection *> starved;
+    struct __kernel_timespec drainTimeout;
+
+    // While any timer is armed a timeout request wakes the loop every tick
+    TimingWheel timers;
+    uint64_t nowTick;
+    bool tickArmed;
+    struct __kernel_timespec tickTimeout;
+};
+
+// Every running loop, filled in before any thread starts and never changed after
+static vector<UringLoop *> uringLoops;
+// Set by whichever loop sees a QUIT first
+static atomic<bool> quitRequested(false);
+
+// ***********************************************************
+// ** The C library doesn't wrap the io_uring system calls.
+// ***********************************************************
+static int ioUringSetup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int ringFd, unsigned opcode, void *arg, unsigned argCount) {
+    return syscall(__NR_io_uring_register, ringFd, opcode, arg, argCount);
+}
+
+static __u64 makeUserData(void *object, UringOp op) {
+    return (__u64)(uintptr_t)object | op;
+}
+
+// **************************************************************************************
+// * mapRing()
+// * - Creates the ring and maps its submission queue, completion queue and SQE array.
+// **************************************************************************************
+static bool mapRing(UringLoop &loop, unsigned setupFlags) {
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | setupFlags;
+    params.cq_entries = kCompletionEntries;
+
+    loop.ringFd = ioUringSetup(kRingEntries, &params);
+    if (loop.ringFd == -1) {
+        return false;
+    }
+
+    loop.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        loop.sqRingSize = max(loop.sqRingSize, loop.cqRingSize);
+        loop.cqRingSize = loop.sqRingSize;
+    }
+
+    loop.sqRing = mmap(NULL, loop.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       loop.ringFd, IORING_OFF_SQ_RING);
+    if (loop.sqRing == MAP_FAILED) {
+        loop.sqRing = NULL;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        loop.cqRing = loop.sqRing;
+    } else {
+        loop.cqRing = mmap(NULL, loop.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           loop.ringFd, IORING_OFF_CQ_RING);
+        if (loop.cqRing == MAP_FAILED) {
+            loop.cqRing = NULL;
+            return false;
+        }
+    }
+
+    loop.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, loop.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop.ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    loop.sqes = (struct io_uring_sqe *)sqes;
+
+    char *sq = (char *)loop.sqRing;
+    loop.sqHead = (unsigned *)(sq + params.sq_off.head);
+    loop.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    loop.sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    loop.sqArray = (unsigned *)(sq + params.sq_off.array);
+    loop.sqLocalTail = *loop.sqTail;
+    loop.pendingSubmits = 0;
+
+    char *cq = (char *)loop.cqRing;
+    loop.cqHead = (unsigned *)(cq + params.cq_off.head);
+    loop.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    loop.cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    loop.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// **************************************************************************************
+// * recycleBuffer()
+// * - Hands a provided buffer back to the kernel so multishot recv can fill it again.
+// **************************************************************************************
+static void recycleBuffer(UringLoop &loop, __u16 bufferId) {
+    // Indexed by hand: in C++ the kernel header's flexible array member doesn't start at
+    // offset 0 the way it does in C
+    struct io_uring_buf *buf = (struct io_uring_buf *)loop.bufRing + (loop.bufTail & (kBufferCount - 1));
+    buf->addr = (__u64)(uintptr_t)(loop.buffers + (size_t)bufferId * kBufferSize);
+    buf->len = kBufferSize;
+    buf->bid = bufferId;
+    loop.bufTail++;
+    __atomic_store_n(&loop.bufRing->tail, loop.bufTail, __ATOMIC_RELEASE);
+    loop.buffersReturned = true;
+}
+
+// **************************************************************************************
+// * registerBuffers()
+// * - Allocates the provided buffer ring, registers it with the kernel and fills it.
+// **************************************************************************************
+static bool registerBuffers(UringLoop &loop) {
+    loop.bufRingSize = kBufferCount * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, loop.bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    loop.bufRing = (struct io_uring_buf_ring *)ring;
+
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (__u64)(uintptr_t)ring;
+    reg.ring_entries = kBufferCount;
+    reg.bgid = kBufferGroup;
+    if (ioUringRegister(loop.ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        return false;
+    }
+
+    loop.buffers = new char[(size_t)kBufferCount * kBufferSize];
+    loop.bufTail = 0;
+    for (unsigned i = 0; i < kBufferCount; i++) {
+        recycleBuffer(loop, i);
+    }
+    return true;
+}
+
+// **************************************************************************************
+// * releaseRing()
+// * - Unmaps and closes everything mapRing() and registerBuffers() set up.
+// **************************************************************************************
+static void releaseRing(UringLoop &loop) {
+    if (loop.sqes != NULL) {
+        munmap(loop.sqes, loop.sqesSize);
+    }
+    if (loop.cqRing != NULL && loop.cqRing != loop.sqRing) {
+        munmap(loop.cqRing, loop.cqRingSize);
+    }
+    if (loop.sqRing != NULL) {
+        munmap(loop.sqRing, loop.sqRingSize);
+    }
+    if (loop.bufRing != NULL) {
+        munmap(loop.bufRing, loop.bufRingSize);
+    }
+    delete[] loop.buffers;
+    if (loop.ringFd != -1) {
+        close(loop.ringFd);
+    }
+    if (loop.wakeFd != -1) {
+        close(loop.wakeFd);
+    }
+}
+
+// **************************************************************************************
+// * uringAvailable()
+// * - Sets up and tears down a throwaway ring to find out whether this kernel supports
+// *   everything the io_uring backend needs. IORING_SETUP_SINGLE_ISSUER arrived in the
+// *   same release as multishot recv, so a kernel that accepts it has both.
+// **************************************************************************************
+bool uringAvailable() {
+    UringLoop probe = UringLoop();
+    probe.ringFd = -1;
+    probe.wakeFd = -1;
+    bool available = mapRing(probe, IORING_SETUP_SINGLE_ISSUER) && registerBuffers(probe);
+    releaseRing(probe);
+    return available;
+}
+
+// **************************************************************************************
+// * submitPending()
+// * - Publishes the SQEs queued so far and optionally waits for one completion.
+// **************************************************************************************
+static void submitPending(UringLoop &loop, bool wait) {
+    __atomic_store_n(loop.sqTail, loop.sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = loop.pendingSubmits;
+    loop.pendingSubmits = 0;
+
+    while (ioUringEnter(loop.ringFd, toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0) == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+    }
+}
+
+// **************************************************************************************
+// * getSqe()
+// * - Returns a cleared SQE, submitting what's queued first if the queue is full.
+// **************************************************************************************
+static struct io_uring_sqe *getSqe(UringLoop &loop) {
+    unsigned head = __atomic_load_n(loop.sqHead, __ATOMIC_ACQUIRE);
+    if (loop.sqLocalTail - head > loop.sqMask) {
+        submitPending(loop, false);
+    }
+
+    unsigned index = loop.sqLocalTail & loop.sqMask;
+    struct io_uring_sqe *sqe = &loop.sqes[index];
+    bzero(sqe, sizeof(*sqe));
+    loop.sqArray[index] = index;
+    loop.sqLocalTail++;
+    loop.pendingSubmits++;
+    return sqe;
+}
+
+static void armAccept(UringLoop &loop) {
+    struct io_uring_sqe *sqe = getSqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop.listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = makeUserData(&loop, OP_ACCEPT);
+    loop.acceptArmed = true;
+}
+
+static void armWake(UringLoop &loop) {
+    struct io_uring_sqe *sqe = getSqe(loop);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop.wakeFd;
+    sqe->addr = (__u64)(uintptr_t)&loop.wakeValue;
+    sqe->len = sizeof(loop.wakeValue);
+    sqe->user_data = makeUserData(&loop, OP_WAKE);
+}
+
+static void armRecv(UringLoop &loop, UringConnection *conn) {
+    struct io_uring_sqe *sqe = getSqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = 1U << IOSQE_BUFFER_SELECT_BIT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = makeUserData(conn, OP_RECV);
+    conn->recvArmed = true;
+}
+
+static void cancelRequest(UringLoop &loop, __u64 userData) {
+    struct io_uring_sqe *sqe = getSqe(loop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = userData;
+    sqe->user_data = makeUserData(&loop, OP_CANCEL);
+}
+
+// **************************************************************************************
+// * startSends()
+// * - Submits every queued buffer as one chain of linked sends. Only one chain per
+// *   connection is in flight at a time, which keeps the echoed bytes in order.
+// **************************************************************************************
+static void startSends(UringLoop &loop, UringConnection *conn) {
+    if (conn->sendsInFlight > 0 || conn->queued.empty()) {
+        return;
+    }
+
+    // inFlight isn't touched again until the whole chain has completed, so the
+    // inline bytes stay put while the kernel reads them
+    conn->inFlight.swap(conn->queued);
+    for (size_t i = 0; i < conn->inFlight.size(); i++) {
+        UringSend &send = conn->inFlight[i];
+        struct io_uring_sqe *sqe = getSqe(loop);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        if (send.bufferId == kInlineSend) {
+            sqe->addr = (__u64)(uintptr_t)send.inlineData;
+        } else if (send.bufferId == kOwnedSend) {
+            sqe->addr = (__u64)(uintptr_t)send.ownedData;
+        } else {
+            sqe->addr = (__u64)(uintptr_t)(loop.buffers + (size_t)send.bufferId * kBufferSize + send.offset);
+        }
+        sqe->len = send.length;
+        // MSG_WAITALL makes the kernel retry short sends instead of breaking the chain
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (i + 1 < conn->inFlight.size()) {
+            sqe->flags = 1U << IOSQE_IO_LINK_BIT;
+        }
+        sqe->user_data = makeUserData(conn, OP_SEND);
+    }
+    conn->sendsInFlight = conn->inFlight.size();
+}
+
+// **************************************************************************************
+// * dropSends()
+// * - Forgets a list of sends, returning the buffers they would have released.
+// **************************************************************************************
+static void dropSends(UringLoop &loop, vector<UringSend> &sends) {
+    for (size_t i = 0; i < sends.size(); i++) {
+        if (sends[i].releasesBuffer) {
+            recycleBuffer(loop, sends[i].bufferId);
+        }
+        delete[] sends[i].ownedData;
+    }
+    sends.clear();
+}
+
+// **************************************************************************************
+// * releaseIfDone()
+// * - Closes and frees a closing connection once no request refers to it any more.
+// **************************************************************************************
+static void releaseIfDone(UringLoop &loop, UringConnection *conn) {
+    if (!conn->closing || conn->recvArmed || conn->sendsInFlight > 0) {
+        return;
+    }
+    DEBUG << "Closing connection on " << conn->fd << ENDL;
+
+    dropSends(loop, conn->queued);
+    cancelTimer(loop.timers, conn->timer);
+    vector<UringConnection *>::iterator starved = find(loop.starved.begin(), loop.starved.end(), conn);
+    if (starved != loop.starved.end()) {
+        loop.starved.erase(starved);
+    }
+    loop.connections[conn->fd] = NULL;
+    close(conn->fd);
+    loop.activeConnections--;
+    countStat(loop.stats->closed);
+    delete conn;
+}
+
+// **************************************************************************************
+// * beginClose()
+// * - Stops receiving on the connection; queued output still goes out first.
+// **************************************************************************************
+static void beginClose(UringLoop &loop, UringConnection *conn, bool dropOutput) {
+    if (!conn->closing && conn->recvArmed) {
+        cancelRequest(loop, makeUserData(conn, OP_RECV));
+    }
+    conn->closing = true;
+    if (dropOutput) {
+        dropSends(loop, conn->queued);
+    } else {
+        startSends(loop, conn);
+    }
+    releaseIfDone(loop, conn);
+}
+
+// **************************************************************************************
+// * requestQuit()
+// * - Tells every loop, including the calling one, to stop accepting and drain.
+// **************************************************************************************
+static void requestQuit() {
+    if (quitRequested.exchange(true)) {
+        return;
+    }
+    for (size_t i = 0; i < uringLoops.size(); i++) {
+        uint64_t one = 1;
+        if (uringLoops[i]->wakeFd != -1 && write(uringLoops[i]->wakeFd, &one, sizeof(one)) == -1) {
+            perror("write(eventfd)");
+        }
+    }
+}
+
+// **************************************************************************************
+// * scheduleTimeout()
+// * - Makes sure the connection's timer fires no later than its deadline.
+// **************************************************************************************
+static void scheduleTimeout(UringLoop &loop, UringConnection *conn) {
+    uint64_t deadline = timeoutDeadline(conn->lastRead, conn->lastWrite, conn->queuedBytes > 0,
+                                        inputUnfinished(conn->parser, conn->frames));
+    if (deadline != 0 && (!timerArmed(conn->timer) || deadline < conn->timer.expiresTick)) {
+        armTimer(loop.timers, conn->timer, deadline);
+    }
+}
+
+// **************************************************************************************
+// * expireConnection()
+// * - Called by the timing wheel. A connection that really timed out is shut down, which
+// *   also fails any send stuck on a client that stopped reading, and then closed.
+// **************************************************************************************
+static void expireConnection(UringLoop &loop, UringConnection *conn) {
+    uint64_t deadline = timeoutDeadline(conn->lastRead, conn->lastWrite, conn->queuedBytes > 0,
+                                        inputUnfinished(conn->parser, conn->frames));
+    if (deadline == 0) {
+        return;
+    }
+    if (deadline > loop.nowTick) {
+        armTimer(loop.timers, conn->timer, deadline);
+        return;
+    }
+    DEBUG << "Connection on " << conn->fd << " timed out" << ENDL;
+    countStat(loop.stats->timeouts);
+    shutdown(conn->fd, SHUT_RDWR);
+    beginClose(loop, conn, true);
+}
+
+// **************************************************************************************
+// * armTick()
+// * - Wakes the loop after one timer tick.
+// **************************************************************************************
+static void armTick(UringLoop &loop) {
+    struct io_uring_sqe *sqe = getSqe(loop);
+    loop.tickTimeout.tv_sec = 0;
+    loop.tickTimeout.tv_nsec = kTimerTickMs * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (__u64)(uintptr_t)&loop.tickTimeout;
+    sqe->len = 1;
+    sqe->user_data = makeUserData(&loop, OP_TICK);
+    loop.tickArmed = true;
+}
+
+// **************************************************************************************
+// * handleAccept()
+// * - Sets up a newly accepted connection and arms its multishot recv.
+// **************************************************************************************
+static void handleAccept(UringLoop &loop, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        loop.acceptArmed = false;
+        if (!loop.draining) {
+            armAccept(loop);
+        }
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("accept");
+        }
+        return;
+    }
+
+    int connFd = cqe->res;
+    if (loop.draining) {
+        close(connFd);
+        return;
+    }
+    DEBUG << "We have received a connection on " << connFd << ENDL;
+
+    UringConnection *conn = new UringConnection();
+    conn->fd = connFd;
+    initParser(conn->parser);
+    initFrameParser(conn->frames);
+    conn->queuedBytes = 0;
+    conn->recvPaused = false;
+    conn->recvArmed = false;
+    conn->closing = false;
+    conn->sendsInFlight = 0;
+    initTimer(conn->timer, conn);
+    conn->lastRead = loop.nowTick;
+    conn->lastWrite = loop.nowTick;
+    if ((size_t)connFd >= loop.connections.size()) {
+        loop.connections.resize(connFd + 1, NULL);
+    }
+    loop.connections[connFd] = conn;
+    loop.activeConnections++;
+    countStat(loop.stats->accepted);
+    scheduleTimeout(loop, conn);
+    armRecv(loop, conn);
+}
+
+// **************************************************************************************
+// * queueInput()
+// * - Runs one received buffer through the connection's parser, queues the data runs to
+// *   be echoed straight out of the buffer and acts on any commands. A STATS reply is
+// *   queued in order with the echoed data around it, and so is the error line that
+// *   answers a publish/subscribe command, which this loop doesn't serve.
+// * - Returns true if the connection started closing.
+// **************************************************************************************
+static bool queueInput(UringLoop &loop, UringConnection *conn, __u16 bufferId, size_t length) {
+    const char *data = loop.buffers + (size_t)bufferId * kBufferSize;
+    size_t firstSend = conn->queued.size();
+    bool wasEmpty = conn->queuedBytes == 0;
+
+    auto echo = [&](const char *bytes, size_t count) {
+        UringSend send;
+        send.releasesBuffer = false;
+        send.ownedData = NULL;
+        send.length = count;
+        if (bytes >= data && bytes < data + length) {
+            send.bufferId = bufferId;
+            send.offset = bytes - data;
+        } else if (count <= kMaxHeld) {
+            send.bufferId = kInlineSend;
+            send.offset = 0;
+            memcpy(send.inlineData, bytes, count);
+        } else {
+            send.bufferId = kOwnedSend;
+            send.offset = 0;
+            send.ownedData = new char[count];
+            memcpy(send.ownedData, bytes, count);
+        }
+        conn->queued.push_back(send);
+        conn->queuedBytes += count;
+    };
+
+    // Bytes after a CLOSE or QUIT are dropped
+    Command command = CMD_NONE;
+    size_t offset = 0;
+    while (offset < length && command != CMD_CLOSE && command != CMD_QUIT) {
+        if (CONFIG.framed) {
+            offset += parseFrames(conn->frames, data + offset, length - offset, command, echo);
+        } else {
+            offset += parseInput(conn->parser, data + offset, length - offset, command, echo);
+        }
+        if (command != CMD_NONE) {
+            countStat(loop.stats->commands);
+        }
+        if (command == CMD_STATS || isPubSubCommand(command)) {
+            string reply = command == CMD_STATS ? statsReply() : string(kNoPubSubReply);
+            UringSend send;
+            send.bufferId = kOwnedSend;
+            send.releasesBuffer = false;
+            send.offset = 0;
+            send.length = reply.size();
+            send.ownedData = new char[reply.size()];
+            memcpy(send.ownedData, reply.data(), reply.size());
+            conn->queued.push_back(send);
+            conn->queuedBytes += reply.size();
+        }
+    }
+
+    // The last run taken from the buffer gives it back; with no runs it goes back now
+    size_t last = conn->queued.size();
+    while (last > firstSend && conn->queued[last - 1].bufferId != bufferId) {
+        last--;
+    }
+    if (last > firstSend) {
+        conn->queued[last - 1].releasesBuffer = true;
+    } else {
+        recycleBuffer(loop, bufferId);
+    }
+
+    switch (command) {
+    case CMD_CLOSE:
+        DEBUG << "Client on " << conn->fd << " sent CLOSE" << ENDL;
+        beginClose(loop, conn, false);
+        return true;
+    case CMD_QUIT:
+        cout << "Client sent QUIT" << endl;
+        requestQuit();
+        beginClose(loop, conn, false);
+        return true;
+    default:
+        break;
+    }
+
+    // The client has until the write timeout to start taking this, and until the read
+    // timeout to finish a line or frame left unfinished
+    if (wasEmpty && conn->queuedBytes > 0) {
+        conn->lastWrite = loop.nowTick;
+    }
+    scheduleTimeout(loop, conn);
+    if (!conn->recvPaused && conn->queuedBytes >= CONFIG.highWatermark) {
+        DEBUG << "Pausing reads on " << conn->fd << ", " << conn->queuedBytes << " bytes queued" << ENDL;
+        conn->recvPaused = true;
+        if (conn->recvArmed) {
+            cancelRequest(loop, makeUserData(conn, OP_RECV));
+        }
+    }
+    startSends(loop, conn);
+    return false;
+}
+
+// **************************************************************************************
+// * handleRecv()
+// * - Takes one chunk from a multishot recv and either queues it to be echoed or acts
+// *   on the command in it.
+// **************************************************************************************
+static void handleRecv(UringLoop &loop, UringConnection *conn, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recvArmed = false;
+    }
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        __u16 bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        countStat(loop.stats->bytesIn, cqe->res);
+        conn->lastRead = loop.nowTick;
+        if (conn->closing) {
+            recycleBuffer(loop, bufferId);
+        } else if (queueInput(loop, conn, bufferId, cqe->res)) {
+            return;
+        }
+    } else if (cqe->res == -ENOBUFS) {
+        // Every buffer is waiting to be sent somewhere; re-arm once some come back
+        if (!conn->recvArmed && !conn->closing && !conn->recvPaused) {
+            loop.starved.push_back(conn);
+        }
+        return;
+    } else if (cqe->res == 0) {
+        DEBUG << "Client on " << conn->fd << " closed the connection" << ENDL;
+        beginClose(loop, conn, false);
+        return;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        cerr << "Error reading from socket" << endl;
+        countStat(loop.stats->readErrors);
+        beginClose(loop, conn, true);
+        return;
+    }
+
+    if (!conn->recvArmed && !conn->closing && !conn->recvPaused) {
+        armRecv(loop, conn);
+    }
+    releaseIfDone(loop, conn);
+}
+
+// **************************************************************************************
+// * handleSend()
+// * - Returns the sent buffer to the kernel and starts the next chain once this one ends.
+// **************************************************************************************
+static void handleSend(UringLoop &loop, UringConnection *conn, struct io_uring_cqe *cqe) {
+    size_t index = conn->inFlight.size() - conn->sendsInFlight;
+    if (conn->inFlight[index].releasesBuffer) {
+        recycleBuffer(loop, conn->inFlight[index].bufferId);
+    }
+    delete[] conn->inFlight[index].ownedData;
+    conn->queuedBytes -= conn->inFlight[index].length;
+    if (cqe->res > 0) {
+        countStat(loop.stats->bytesOut, cqe->res);
+        conn->lastWrite = loop.nowTick;
+    }
+    conn->sendsInFlight--;
+
+    if (conn->recvPaused && conn->queuedBytes <= CONFIG.lowWatermark) {
+        DEBUG << "Resuming reads on " << conn->fd << ENDL;
+        conn->recvPaused = false;
+        if (!conn->recvArmed && !conn->closing) {
+            armRecv(loop, conn);
+        }
+    }
+
+    if (cqe->res < 0 && cqe->res != -ECANCELED && !conn->closing) {
+        cerr << "Error writing to socket" << endl;
+        countStat(loop.stats->writeErrors);
+        beginClose(loop, conn, true);
+    }
+
+    if (conn->sendsInFlight == 0) {
+        conn->inFlight.clear();
+        if (conn->closing && cqe->res < 0) {
+            dropSends(loop, conn->queued);
+        }
+        startSends(loop, conn);
+        // A burst can leave both lists with a lot of room; an idle connection gives it back
+        if (conn->sendsInFlight == 0 && conn->inFlight.capacity() + conn->queued.capacity() > kKeptSends) {
+            vector<UringSend>().swap(conn->inFlight);
+            vector<UringSend>().swap(conn->queued);
+        }
+    }
+    releaseIfDone(loop, conn);
+}
+
+// **************************************************************************************
+// * beginDrain()
+// * - Called once after a QUIT. Stops accepting and closes every connection once what
+// *   it already owes its client has been sent.
+// **************************************************************************************
+static void beginDrain(UringLoop &loop) {
+    loop.draining = true;
+    if (loop.acceptArmed) {
+        cancelRequest(loop, makeUserData(&loop, OP_ACCEPT));
+    }
+
+    for (size_t fd = 0; fd < loop.connections.size(); fd++) {
+        UringConnection *conn = loop.connections[fd];
+        if (conn != NULL && !conn->closing) {
+            beginClose(loop, conn, false);
+        }
+    }
+
+    // Give slow readers a bounded amount of time
+    struct io_uring_sqe *sqe = getSqe(loop);
+    loop.drainTimeout.tv_sec = kDrainTimeoutSec;
+    loop.drainTimeout.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (__u64)(uintptr_t)&loop.drainTimeout;
+    sqe->len = 1;
+    sqe->user_data = makeUserData(&loop, OP_TIMEOUT);
+}
+
+// **************************************************************************************
+// * runUringLoop()
+// * - Sets up a ring on the calling thread and serves clients of one listening socket
+// *   until any client sends QUIT and this loop's connections have drained.
+// **************************************************************************************
+static void runUringLoop(UringLoop *loopPtr) {
+    UringLoop &loop = *loopPtr;
+    if (!mapRing(loop, IORING_SETUP_SINGLE_ISSUER) || !registerBuffers(loop)) {
+        perror("io_uring setup");
+        requestQuit();
+        return;
+    }
+    DEBUG << "Loop " << loop.id << " io_uring ready on descriptor " << loop.ringFd << ENDL;
+
+    armAccept(loop);
+    armWake(loop);
+
+    auto expire = [&](void *owner) { expireConnection(loop, (UringConnection *)owner); };
+    bool timedOut = false;
+    while (!timedOut && (!loop.draining || loop.activeConnections > 0)) {
+        submitPending(loop, true);
+        loop.nowTick = currentTimerTick();
+
+        unsigned head = *loop.cqHead;
+        unsigned tail = __atomic_load_n(loop.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &loop.cqes[head & loop.cqMask];
+            __u64 op = cqe->user_data & kOpMask;
+            void *object = (void *)(uintptr_t)(cqe->user_data & ~kOpMask);
+
+            switch (op) {
+            case OP_ACCEPT:
+                handleAccept(loop, cqe);
+                break;
+            case OP_WAKE:
+                if (!quitRequested.load(memory_order_relaxed)) {
+                    armWake(loop);
+                }
+                break;
+            case OP_RECV:
+                handleRecv(loop, (UringConnection *)object, cqe);
+                break;
+            case OP_SEND:
+                handleSend(loop, (UringConnection *)object, cqe);
+                break;
+            case OP_TIMEOUT:
+                cout << "Drain timed out, closing " << loop.activeConnections << " connections" << endl;
+                timedOut = true;
+                break;
+            case OP_TICK:
+                loop.tickArmed = false;
+                break;
+            default:
+                break;
+            }
+        }
+        __atomic_store_n(loop.cqHead, head, __ATOMIC_RELEASE);
+
+        // Connections that ran out of buffers get another try once some were returned
+        if (loop.buffersReturned && !loop.starved.empty()) {
+            vector<UringConnection *> starved;
+            starved.swap(loop.starved);
+            for (size_t i = 0; i < starved.size(); i++) {
+                if (!starved[i]->recvArmed && !starved[i]->closing && !starved[i]->recvPaused) {
+                    armRecv(loop, starved[i]);
+                }
+            }
+        }
+        loop.buffersReturned = false;
+
+        advanceWheel(loop.timers, loop.nowTick, expire);
+        if (loop.timers.armed > 0 && !loop.tickArmed) {
+            armTick(loop);
+        }
+
+        if (!loop.draining && quitRequested.load(memory_order_relaxed)) {
+            beginDrain(loop);
+        }
+    }
+
+    // Closing the ring cancels whatever is still outstanding
+    for (size_t fd = 0; fd < loop.connections.size(); fd++) {
+        if (loop.connections[fd] != NULL) {
+            close((int)fd);
+            delete loop.connections[fd];
+        }
+    }
+    loop.connections.clear();
+}
+
+// **************************************************************************************
+// * runUringLoops()
+// * - io_uring counterpart of runEventLoops(): one ring per listening socket, the first
+// *   on the calling thread and the rest on threads of their own.
+// * - Returns false if a loop couldn't be set up.
+// **************************************************************************************
+bool runUringLoops(const vector<int> &listenFds) {
+    bool setupOk = true;
+    for (size_t i = 0; i < listenFds.size(); i++) {
+        UringLoop *loop = new UringLoop();
+        loop->id = i;
+        loop->stats = &workerStats(i);
+        initTimingWheel(loop->timers, kTimerSlots);
+        loop->nowTick = loop->timers.currentTick;
+        loop->ringFd = -1;
+        loop->listenFd = listenFds[i];
+        loop->wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (loop->wakeFd == -1) {
+            perror("eventfd");
+            setupOk = false;
+        }
+        uringLoops.push_back(loop);
+    }
+
+    if (setupOk) {
+        vector<thread> workers;
+        for (size_t i = 1; i < uringLoops.size(); i++) {
+            workers.push_back(thread(runUringLoop, uringLoops[i]));
+        }
+        DEBUG << "Started " << uringLoops.size() << " io_uring loops" << ENDL;
+
+        runUringLoop(uringLoops[0]);
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    for (size_t i = 0; i < uringLoops.size(); i++) {
+        releaseRing(*uringLoops[i]);
+        releaseTimingWheel(uringLoops[i]->timers);
+        delete uringLoops[i];
+    }
+    uringLoops.clear();
+    return setupOk;
+}
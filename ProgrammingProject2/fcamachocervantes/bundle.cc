@@ -0,0 +1,90 @@
+#include "bundle.h"
+#include "web_server.h"
+#include <cstdio>
+#include <sys/mman.h>
+#include <unordered_set>
+
+using namespace std;
+
+//**************************************************************************************
+//* spanView()
+//* - The bytes a span covers, if they all lie inside the bundle.
+//**************************************************************************************
+static bool spanView(const Bundle &bundle, const BundleSpan &span, string_view &view)
+{
+    if (span.offset > bundle.size || span.length > bundle.size - span.offset)
+    {
+        return false;
+    }
+    view = string_view(bundle.data + span.offset, span.length);
+    return true;
+}
+
+bool openBundle(Bundle &bundle, const char *path)
+{
+    bundle.fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat bundleStat;
+    if (bundle.fd == -1 || fstat(bundle.fd, &bundleStat) == -1)
+    {
+        perror(path);
+        return false;
+    }
+    bundle.size = bundleStat.st_size;
+    if (bundle.size < sizeof(BundleHeader))
+    {
+        cout << path << " is not a bundle" << endl;
+        return false;
+    }
+    void *data = mmap(NULL, bundle.size, PROT_READ, MAP_SHARED, bundle.fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+    bundle.data = (const char *)data;
+
+    BundleHeader header;
+    memcpy(&header, bundle.data, sizeof(header));
+    if (memcmp(header.magic, kBundleMagic, sizeof(kBundleMagic)) != 0 || header.version != kBundleVersion)
+    {
+        cout << path << " is not a version " << kBundleVersion << " bundle" << endl;
+        return false;
+    }
+    string_view index;
+    BundleSpan indexSpan = {header.index, (uint64_t)header.count * sizeof(BundleEntry)};
+    if (header.count > bundle.size / sizeof(BundleEntry) || !spanView(bundle, indexSpan, index))
+    {
+        cout << path << " has a bad index" << endl;
+        return false;
+    }
+
+    //Every span is checked once here, so serving never has to. Names must be unique too,
+    //or the route table could never be built
+    bundle.files.resize(header.count);
+    unordered_set<string_view> names;
+    for (size_t i = 0; i < header.count; i++)
+    {
+        BundleEntry entry;
+        memcpy(&entry, index.data() + i * sizeof(BundleEntry), sizeof(entry));
+        BundledFile &file = bundle.files[i];
+        string_view etag;
+        if (!spanView(bundle, entry.name, file.name) || !spanView(bundle, entry.etag, etag) ||
+            !spanView(bundle, entry.header, file.header) ||
+            !spanView(bundle, entry.notModifiedHeader, file.notModifiedHeader) ||
+            !spanView(bundle, entry.body, file.body))
+        {
+            cout << path << " has a bad entry " << i << endl;
+            return false;
+        }
+        if (!names.insert(file.name).second)
+        {
+            cout << path << " has more than one entry for " << file.name << endl;
+            return false;
+        }
+        file.bodyOffset = entry.body.offset;
+        file.validators.etag.assign(etag);
+        file.validators.lastModified = entry.lastModified;
+    }
+    DEBUG << "Mapped " << bundle.files.size() << " files from " << path << ENDL;
+    return true;
+}
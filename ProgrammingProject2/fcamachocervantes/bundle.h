@@ -0,0 +1,86 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+#include "response_cache.h"
+
+//********************************************************
+//* Asset bundles: every file the server hands out, packed
+//* into one file by bundle_packer.
+//*
+//* A bundle starts with a BundleHeader. After it come, for
+//* each file, its name, its ETag, the headers of its 200
+//* and 304 responses and its bytes, and at the end an index
+//* with a BundleEntry per file giving where each of those
+//* is. Offsets are from the start of the bundle and numbers
+//* are in the byte order of the machine that packed it.
+//*
+//* The server maps the whole bundle at startup and builds
+//* its routes from the index, so serving a file takes no
+//* open(), stat() or read(). Headers and small bodies are
+//* sent straight out of the mapping; bigger bodies go out
+//* with sendfile() from their offset in the bundle.
+//********************************************************
+static const char kBundleMagic[8] = {'W', 'S', 'B', 'U', 'N', 'D', 'L', 'E'};
+static const uint32_t kBundleVersion = 1;
+
+struct BundleHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index;
+};
+
+// Where a piece of the bundle is
+struct BundleSpan
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct BundleEntry
+{
+    BundleSpan name;
+    BundleSpan etag;
+    // Status line and headers, up to but not including the Connection header
+    BundleSpan header;
+    BundleSpan notModifiedHeader;
+    BundleSpan body;
+    int64_t lastModified;
+};
+
+//********************************************************
+//* A file in a mapped bundle, with views into the mapping.
+//********************************************************
+struct BundledFile
+{
+    std::string_view name;
+    std::string_view header;
+    std::string_view notModifiedHeader;
+    std::string_view body;
+    // Where the body starts in the bundle, for sendfile()
+    off_t bodyOffset;
+    Validators validators;
+};
+
+struct Bundle
+{
+    int fd;
+    const char *data;
+    size_t size;
+    std::vector<BundledFile> files;
+};
+
+//**************************************************************************************
+//* openBundle()
+//* - Maps a bundle and reads its index. Returns false, with a message, if the file
+//*   can't be mapped or isn't a bundle this server can read.
+//**************************************************************************************
+bool openBundle(Bundle &bundle, const char *path);
+
+#endif
@@ -0,0 +1,174 @@
+#include "web_server.h"
+#include "bundle.h"
+#include "response_cache.h"
+#include "router.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+bool VERBOSE;
+using namespace std;
+
+//********************************************************
+//* bundle_packer packs every file the server would serve
+//* from a directory into one bundle for web_server -B.
+//* The response headers are the server's own, built here
+//* once so the server never has to.
+//********************************************************
+
+//**************************************************************************************
+//* writeSpan()
+//* - Appends bytes to the bundle being written and says where they went.
+//**************************************************************************************
+static bool writeSpan(FILE *bundleFile, const string &data, BundleSpan &span)
+{
+    span.offset = ftello(bundleFile);
+    span.length = data.size();
+    return fwrite(data.data(), 1, data.size(), bundleFile) == data.size();
+}
+
+//**************************************************************************************
+//* copyBody()
+//* - Appends exactly length bytes of an open file to the bundle. Returns false if the
+//*   file can't be read or has changed size since fstat().
+//**************************************************************************************
+static bool copyBody(FILE *bundleFile, int fileFD, off_t length, BundleSpan &span)
+{
+    span.offset = ftello(bundleFile);
+    span.length = length;
+    char buffer[65536];
+    off_t copied = 0;
+    while (copied < length)
+    {
+        ssize_t bytesRead = read(fileFD, buffer, sizeof(buffer));
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead <= 0 || copied + bytesRead > length)
+        {
+            return false;
+        }
+        if (fwrite(buffer, 1, bytesRead, bundleFile) != (size_t)bytesRead)
+        {
+            return false;
+        }
+        copied += bytesRead;
+    }
+    return true;
+}
+
+//**************************************************************************************
+//* packFile()
+//* - Appends one file, its ETag and its headers to the bundle and fills in its entry.
+//**************************************************************************************
+static bool packFile(FILE *bundleFile, int rootFD, const string &fileName, BundleEntry &entry)
+{
+    int fileFD = openat(rootFD, fileName.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat fileStat;
+    if (fileFD == -1 || fstat(fileFD, &fileStat) == -1)
+    {
+        perror(fileName.c_str());
+        if (fileFD != -1)
+        {
+            close(fileFD);
+        }
+        return false;
+    }
+    Validators validators = fileValidators(fileStat);
+    entry.lastModified = validators.lastModified;
+    //No gzip variant is packed, so nothing served from the bundle varies with Accept-Encoding
+    bool packed = writeSpan(bundleFile, fileName, entry.name) && writeSpan(bundleFile, validators.etag, entry.etag) &&
+                  writeSpan(bundleFile, responseHeader(fileName, fileStat.st_size, validators, false, false),
+                            entry.header) &&
+                  writeSpan(bundleFile, notModifiedHeader(fileName, validators, false), entry.notModifiedHeader) &&
+                  copyBody(bundleFile, fileFD, fileStat.st_size, entry.body);
+    close(fileFD);
+    if (!packed)
+    {
+        cout << "Couldn't pack " << fileName << endl;
+    }
+    return packed;
+}
+
+static void usage(const char *program)
+{
+    cout << "usage: " << program << " [-v] bundle [directory, default " << kDefaultDocumentRoot << "]" << endl;
+    exit(-1);
+}
+
+//**************************************************************************************
+//* main()
+//* - Writes the bundle to a temporary file and renames it into place, so a server
+//*   starting up never maps a half-written bundle.
+//**************************************************************************************
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            VERBOSE = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2)
+    {
+        usage(argv[0]);
+    }
+    string bundleName = argv[optind];
+    const char *root = optind + 1 < argc ? argv[optind + 1] : kDefaultDocumentRoot;
+
+    int rootFD = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFD == -1)
+    {
+        perror(root);
+        exit(-1);
+    }
+    vector<string> fileNames = servedFiles(root);
+
+    string tempName = bundleName + ".tmp";
+    FILE *bundleFile = fopen(tempName.c_str(), "wb");
+    if (bundleFile == NULL)
+    {
+        perror(tempName.c_str());
+        exit(-1);
+    }
+
+    //The header is written again at the end, once the index's place is known
+    BundleHeader header;
+    memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+    header.version = kBundleVersion;
+    header.count = fileNames.size();
+    header.index = 0;
+    bool packed = fwrite(&header, sizeof(header), 1, bundleFile) == 1;
+
+    vector<BundleEntry> entries(fileNames.size());
+    for (size_t i = 0; packed && i < fileNames.size(); i++)
+    {
+        DEBUG << "Packing " << fileNames[i] << ENDL;
+        packed = packFile(bundleFile, rootFD, fileNames[i], entries[i]);
+    }
+    if (packed)
+    {
+        header.index = ftello(bundleFile);
+        packed = fwrite(entries.data(), sizeof(BundleEntry), entries.size(), bundleFile) == entries.size() &&
+                 fseeko(bundleFile, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, bundleFile) == 1;
+    }
+    packed = packed && fflush(bundleFile) == 0 && fsync(fileno(bundleFile)) == 0;
+    packed = fclose(bundleFile) == 0 && packed;
+    close(rootFD);
+    if (!packed || rename(tempName.c_str(), bundleName.c_str()) == -1)
+    {
+        perror(bundleName.c_str());
+        unlink(tempName.c_str());
+        exit(-1);
+    }
+    cout << "Packed " << fileNames.size() << " files into " << bundleName << endl;
+    return 0;
+}
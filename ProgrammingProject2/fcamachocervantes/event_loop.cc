@@ -0,0 +1,325 @@
+#include "event_loop.h"
+#include "web_server.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+static const int kMaxEvents = 64;
+// How often, in milliseconds, reactors look for idle connections
+static const int kSweepInterval = 1000;
+// Seconds a connection may wait for its client to read any of a response
+static const int kSendTimeout = 30;
+
+struct Reactor
+{
+    int epollFD;
+    int listenFd;
+    // Set while accepting is paused because the process ran out of file descriptors
+    bool acceptPaused;
+    chrono::steady_clock::time_point acceptPausedAt;
+    // Guards both lists and every connection's place in them
+    mutex lock;
+    list<Connection *> idle;
+    list<Connection *> writing;
+};
+
+//********************************************************
+//* Connections ready to be served, shared by every reactor
+//* and worker.
+//********************************************************
+struct WorkQueue
+{
+    mutex lock;
+    condition_variable ready;
+    deque<Connection *> connections;
+};
+
+static WorkQueue workQueue;
+
+//**************************************************************************************
+//* destroyConnection()
+//* - Closes a connection and frees it along with anything still queued on it.
+//**************************************************************************************
+static void destroyConnection(Connection *connection)
+{
+    close(connection->fd);
+    freeOutput(connection->output);
+    delete connection;
+}
+
+//**************************************************************************************
+//* armConnection()
+//* - Puts a connection back in its reactor's idle list, or its writing list if it is
+//*   waiting to send, and asks epoll for its next event. Done under the reactor's lock
+//*   so the reactor can't close the connection in between.
+//**************************************************************************************
+static void armConnection(Connection *connection, int operation, bool writing)
+{
+    Reactor *reactor = connection->reactor;
+    lock_guard<mutex> guard(reactor->lock);
+    connection->lastActive = chrono::steady_clock::now();
+    connection->writing = writing;
+    list<Connection *> &waiting = writing ? reactor->writing : reactor->idle;
+    connection->idle = waiting.insert(waiting.end(), connection);
+
+    //A client that has shut down its side still reads, so only EPOLLOUT wakes a writer
+    struct epoll_event event;
+    event.events = (writing ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT;
+    event.data.ptr = connection;
+    if (epoll_ctl(reactor->epollFD, operation, connection->fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+    }
+}
+
+//**************************************************************************************
+//* armListener()
+//* - Has the reactor's epoll report new connections on the listening socket. With
+//*   EPOLLEXCLUSIVE only one reactor is woken for each.
+//**************************************************************************************
+static void armListener(Reactor *reactor)
+{
+    //The listening socket is the one entry without a connection
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, reactor->listenFd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        exit(-1);
+    }
+}
+
+//**************************************************************************************
+//* pauseAccepting()
+//* - Takes the listening socket out of the reactor's epoll when accept4() can't get a
+//*   file descriptor. The socket stays readable, so leaving it in would wake the
+//*   reactor on every pass. resumeAccepting() puts it back a sweep later, by when
+//*   connections may have closed.
+//**************************************************************************************
+static void pauseAccepting(Reactor *reactor)
+{
+    cout << "accept4: " << strerror(errno) << ", not accepting for " << kSweepInterval << " ms" << endl;
+    if (epoll_ctl(reactor->epollFD, EPOLL_CTL_DEL, reactor->listenFd, NULL) == -1)
+    {
+        perror("epoll_ctl");
+        exit(-1);
+    }
+    reactor->acceptPaused = true;
+    reactor->acceptPausedAt = chrono::steady_clock::now();
+}
+
+static void resumeAccepting(Reactor *reactor)
+{
+    if (reactor->acceptPaused &&
+        chrono::steady_clock::now() - reactor->acceptPausedAt >= chrono::milliseconds(kSweepInterval))
+    {
+        reactor->acceptPaused = false;
+        armListener(reactor);
+    }
+}
+
+//**************************************************************************************
+//* acceptConnections()
+//* - Accepts every connection waiting on the listening socket, already non-blocking.
+//**************************************************************************************
+static void acceptConnections(Reactor *reactor)
+{
+    while (true)
+    {
+        int connFd = accept4(reactor->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connFd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                pauseAccepting(reactor);
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("accept4");
+            }
+            return;
+        }
+        DEBUG << "We have received a connection on " << connFd << ENDL;
+
+        //Each response is written whole, so Nagle's algorithm would only hold back the
+        //next one until the last is acknowledged
+        int noDelay = 1;
+        if (setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) == -1)
+        {
+            perror("setsockopt");
+        }
+
+        Connection *connection = new Connection;
+        connection->fd = connFd;
+        connection->reactor = reactor;
+        connection->output = NULL;
+        initRequestParser(connection->parser);
+        armConnection(connection, EPOLL_CTL_ADD, false);
+    }
+}
+
+//**************************************************************************************
+//* dispatchConnection()
+//* - Takes a connection that has something to read, or room to write, out of its list
+//*   and hands it to the workers.
+//**************************************************************************************
+static void dispatchConnection(Reactor *reactor, Connection *connection)
+{
+    {
+        lock_guard<mutex> guard(reactor->lock);
+        (connection->writing ? reactor->writing : reactor->idle).erase(connection->idle);
+    }
+    {
+        lock_guard<mutex> guard(workQueue.lock);
+        workQueue.connections.push_back(connection);
+    }
+    workQueue.ready.notify_one();
+}
+
+//**************************************************************************************
+//* closeStale()
+//* - Closes the connections at the front of a list that have been waiting since before
+//*   the cutoff.
+//**************************************************************************************
+static void closeStale(list<Connection *> &waiting, int timeout, const char *reason)
+{
+    chrono::steady_clock::time_point cutoff = chrono::steady_clock::now() - chrono::seconds(timeout);
+    while (!waiting.empty() && waiting.front()->lastActive < cutoff)
+    {
+        Connection *connection = waiting.front();
+        waiting.pop_front();
+        DEBUG << "Connection " << connection->fd << " " << reason << " for " << timeout << " seconds, closing it"
+              << ENDL;
+        destroyConnection(connection);
+    }
+}
+
+//**************************************************************************************
+//* closeIdleConnections()
+//* - Closes connections that have had nothing to read for keepAliveTimeout seconds.
+//*   Those still waiting for their first request are held to it too. With keep-alive
+//*   turned off nothing is timed out for that, as before.
+//* - Also closes connections whose client has taken none of a response for
+//*   kSendTimeout seconds.
+//**************************************************************************************
+static void closeIdleConnections(Reactor *reactor)
+{
+    lock_guard<mutex> guard(reactor->lock);
+    if (keepAliveTimeout > 0)
+    {
+        closeStale(reactor->idle, keepAliveTimeout, "idle");
+    }
+    closeStale(reactor->writing, kSendTimeout, "not reading");
+}
+
+static void runReactor(Reactor *reactor)
+{
+    struct epoll_event events[kMaxEvents];
+    while (true)
+    {
+        int count = epoll_wait(reactor->epollFD, events, kMaxEvents, kSweepInterval);
+        if (count == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            exit(-1);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                acceptConnections(reactor);
+            }
+            else if (events[i].data.ptr == reactor)
+            {
+                serveWatchEvents();
+            }
+            else
+            {
+                dispatchConnection(reactor, (Connection *)events[i].data.ptr);
+            }
+        }
+        closeIdleConnections(reactor);
+        resumeAccepting(reactor);
+    }
+}
+
+//**************************************************************************************
+//* runWorker()
+//* - Serves connections from the work queue, re-arming each one afterwards or closing
+//*   it if it is finished.
+//**************************************************************************************
+static void runWorker()
+{
+    while (true)
+    {
+        Connection *connection = NULL;
+        {
+            unique_lock<mutex> guard(workQueue.lock);
+            workQueue.ready.wait(guard, [] { return !workQueue.connections.empty(); });
+            connection = workQueue.connections.front();
+            workQueue.connections.pop_front();
+        }
+
+        ServeResult result = serveConnection(*connection);
+        if (result == SERVE_CLOSE)
+        {
+            DEBUG << "Closing connection " << connection->fd << ENDL;
+            destroyConnection(connection);
+        }
+        else
+        {
+            armConnection(connection, EPOLL_CTL_MOD, result == SERVE_WRITE);
+        }
+    }
+}
+
+void runServer(int listenFd, int watchFd, int reactorCount, int workerCount)
+{
+    vector<thread> threads;
+    for (int i = 0; i < workerCount; i++)
+    {
+        threads.emplace_back(runWorker);
+    }
+
+    for (int i = 0; i < reactorCount; i++)
+    {
+        Reactor *reactor = new Reactor;
+        reactor->listenFd = listenFd;
+        reactor->acceptPaused = false;
+        reactor->epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epollFD == -1)
+        {
+            perror("epoll_create1");
+            exit(-1);
+        }
+        armListener(reactor);
+        //The watched fd is the entry that points at the reactor itself
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = reactor;
+        if (i == 0 && watchFd != -1 && epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, watchFd, &event) == -1)
+        {
+            perror("epoll_ctl");
+            exit(-1);
+        }
+        threads.emplace_back(runReactor, reactor);
+    }
+    DEBUG << "Serving with " << reactorCount << " reactors and " << workerCount << " workers" << ENDL;
+
+    for (thread &serverThread : threads)
+    {
+        serverThread.join();
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <chrono>
+#include <list>
+#include "http_request.h"
+
+//********************************************************
+//* Event-driven connection handling.
+//*
+//* Reactor threads each run an epoll loop. They all watch
+//* the one listening socket, with EPOLLEXCLUSIVE so a new
+//* connection wakes only one of them, and accept every
+//* pending connection with accept4() before going back to
+//* epoll_wait(). A connection stays with the reactor that
+//* accepted it.
+//*
+//* Connections are non-blocking and registered one-shot.
+//* When one becomes readable its reactor hands it to the
+//* worker pool, and the worker answers every request it can
+//* read without blocking, then re-arms it. One-shot means
+//* only one thread ever has a connection at a time.
+//*
+//* A worker never waits for a client. When a response
+//* doesn't fit in the socket buffer, the rest stays queued
+//* on the connection, which is re-armed for EPOLLOUT, and
+//* the next worker to get it carries on sending.
+//*
+//* Armed connections sit in one of their reactor's lists,
+//* the least recently active first. The reactor closes the
+//* ones left idle for longer than keepAliveTimeout, and the
+//* ones whose client hasn't read any of its responses for
+//* kSendTimeout seconds.
+//********************************************************
+struct Reactor;
+struct OutputQueue;
+
+struct Connection
+{
+    int fd;
+    Reactor *reactor;
+    RequestParser parser;
+    // Responses not yet sent, owned by the server
+    OutputQueue *output;
+    // Waiting for EPOLLOUT rather than for a request
+    bool writing;
+    // Where the connection is in its reactor's idle or writing list while it is armed
+    std::list<Connection *>::iterator idle;
+    std::chrono::steady_clock::time_point lastActive;
+};
+
+extern int keepAliveTimeout;
+
+enum ServeResult
+{
+    SERVE_READ,
+    SERVE_WRITE,
+    SERVE_CLOSE
+};
+
+//**************************************************************************************
+//* serveConnection()
+//* - Supplied by the server. Sends what is queued and answers every request that can
+//*   be read from the connection without blocking. Returns what to wait for next, or
+//*   SERVE_CLOSE once the connection should be closed.
+//**************************************************************************************
+ServeResult serveConnection(Connection &connection);
+
+//**************************************************************************************
+//* freeOutput()
+//* - Supplied by the server. Frees a connection's queued output when it is closed.
+//**************************************************************************************
+void freeOutput(OutputQueue *output);
+
+//**************************************************************************************
+//* serveWatchEvents()
+//* - Supplied by the server. Called on the first reactor whenever the watchFd passed
+//*   to runServer() is readable; it must read the fd until it would block.
+//**************************************************************************************
+void serveWatchEvents();
+
+//**************************************************************************************
+//* runServer()
+//* - Starts the worker pool and the reactors on a non-blocking listening socket and
+//*   serves connections until the process is killed. watchFd, unless it is -1, is a
+//*   non-blocking fd the server wants serveWatchEvents() called for.
+//**************************************************************************************
+void runServer(int listenFd, int watchFd, int reactorCount, int workerCount);
+
+#endif
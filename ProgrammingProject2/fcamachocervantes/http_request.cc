@@ -0,0 +1,487 @@
+#include "http_request.h"
+#include <cstring>
+#include <strings.h>
+
+using namespace std;
+
+void initRequestParser(RequestParser &parser)
+{
+    parser.length = 0;
+    parser.parsed = 0;
+    parser.start = 0;
+    parser.state = STATE_METHOD;
+    parser.methodEnd = 0;
+    parser.targetStart = 0;
+    parser.targetEnd = 0;
+    parser.versionStart = 0;
+    parser.versionEnd = 0;
+    parser.headerCount = 0;
+}
+
+void nextRequest(RequestParser &parser)
+{
+    size_t length = parser.length;
+    size_t parsed = parser.parsed;
+    initRequestParser(parser);
+    //Nothing left over is the usual case, and lets the buffer start over for free
+    if (parsed < length)
+    {
+        parser.length = length;
+        parser.parsed = parsed;
+        parser.start = parsed;
+    }
+}
+
+void compactRequestBuffer(RequestParser &parser)
+{
+    size_t start = parser.start;
+    if (start == 0)
+    {
+        return;
+    }
+    memmove(parser.buffer, parser.buffer + start, parser.length - start);
+    parser.length -= start;
+    parser.parsed -= start;
+    parser.start = 0;
+
+    //Offsets of the parts not reached yet are stale, but they are set before they are
+    //used, so shifting them along with the rest does no harm
+    parser.methodEnd -= start;
+    parser.targetStart -= start;
+    parser.targetEnd -= start;
+    parser.versionStart -= start;
+    parser.versionEnd -= start;
+    for (size_t i = 0; i <= parser.headerCount && i < kMaxHeaders; i++)
+    {
+        parser.headers[i].nameStart -= start;
+        parser.headers[i].nameEnd -= start;
+        parser.headers[i].valueStart -= start;
+        parser.headers[i].valueEnd -= start;
+    }
+}
+
+//**************************************************************************************
+//* isVisible()
+//* - Printable ASCII other than space, the only bytes allowed in a method, a request
+//*   target or a header name.
+//**************************************************************************************
+static bool isVisible(char c)
+{
+    return c > ' ' && c < 127;
+}
+
+//**************************************************************************************
+//* finishRequest()
+//* - Turns the offsets gathered while parsing into views of the buffer.
+//**************************************************************************************
+static void finishRequest(const RequestParser &parser, HttpRequest &request)
+{
+    const char *base = parser.buffer;
+    request.method = string_view(base + parser.start, parser.methodEnd - parser.start);
+    request.target = string_view(base + parser.targetStart, parser.targetEnd - parser.targetStart);
+    request.version = string_view(base + parser.versionStart, parser.versionEnd - parser.versionStart);
+    request.headerCount = parser.headerCount;
+    for (size_t i = 0; i < parser.headerCount; i++)
+    {
+        const HeaderOffsets &header = parser.headers[i];
+        request.headers[i].name = string_view(base + header.nameStart, header.nameEnd - header.nameStart);
+        request.headers[i].value = string_view(base + header.valueStart, header.valueEnd - header.valueStart);
+    }
+}
+
+ParseResult parseRequest(RequestParser &parser, HttpRequest &request)
+{
+    size_t position = parser.parsed;
+    while (position < parser.length && parser.state != STATE_DONE)
+    {
+        char c = parser.buffer[position];
+        HeaderOffsets &header = parser.headers[parser.headerCount < kMaxHeaders ? parser.headerCount : 0];
+        switch (parser.state)
+        {
+        case STATE_METHOD:
+            if (c == ' ' && position > parser.start)
+            {
+                parser.methodEnd = position;
+                parser.targetStart = position + 1;
+                parser.state = STATE_TARGET;
+            }
+            else if (!isVisible(c))
+            {
+                return PARSE_ERROR;
+            }
+            break;
+        case STATE_TARGET:
+            if (c == ' ' && position > parser.targetStart)
+            {
+                parser.targetEnd = position;
+                parser.versionStart = position + 1;
+                parser.state = STATE_VERSION;
+            }
+            else if (!isVisible(c))
+            {
+                return PARSE_ERROR;
+            }
+            break;
+        case STATE_VERSION:
+            // A bare LF line ending is accepted as well as CRLF
+            if (c == '\r' || c == '\n')
+            {
+                parser.versionEnd = position;
+                parser.state = c == '\r' ? STATE_REQUEST_LINE_LF : STATE_HEADER_START;
+            }
+            else if (!isVisible(c))
+            {
+                return PARSE_ERROR;
+            }
+            break;
+        case STATE_REQUEST_LINE_LF:
+        case STATE_HEADER_LF:
+            if (c != '\n')
+            {
+                return PARSE_ERROR;
+            }
+            parser.state = STATE_HEADER_START;
+            break;
+        case STATE_HEADER_START:
+            if (c == '\r')
+            {
+                parser.state = STATE_END_LF;
+            }
+            else if (c == '\n')
+            {
+                parser.state = STATE_DONE;
+            }
+            else if (!isVisible(c) || c == ':' || parser.headerCount == kMaxHeaders)
+            {
+                // Leading whitespace would be an obsolete folded line, which isn't supported
+                return PARSE_ERROR;
+            }
+            else
+            {
+                header.nameStart = position;
+                parser.state = STATE_HEADER_NAME;
+            }
+            break;
+        case STATE_HEADER_NAME:
+            if (c == ':')
+            {
+                header.nameEnd = position;
+                header.valueStart = position + 1;
+                header.valueEnd = position + 1;
+                parser.state = STATE_HEADER_VALUE;
+            }
+            else if (!isVisible(c))
+            {
+                return PARSE_ERROR;
+            }
+            break;
+        case STATE_HEADER_VALUE:
+            if (c == '\r' || c == '\n')
+            {
+                parser.headerCount++;
+                parser.state = c == '\r' ? STATE_HEADER_LF : STATE_HEADER_START;
+            }
+            else if (c == ' ' || c == '\t')
+            {
+                // Whitespace before the value is skipped; after it, valueEnd leaves it out
+                if (header.valueStart == header.valueEnd)
+                {
+                    header.valueStart = position + 1;
+                    header.valueEnd = position + 1;
+                }
+            }
+            else
+            {
+                header.valueEnd = position + 1;
+            }
+            break;
+        case STATE_END_LF:
+            if (c != '\n')
+            {
+                return PARSE_ERROR;
+            }
+            parser.state = STATE_DONE;
+            break;
+        case STATE_DONE:
+            break;
+        }
+        position++;
+    }
+    parser.parsed = position;
+
+    if (parser.state == STATE_DONE)
+    {
+        finishRequest(parser, request);
+        return PARSE_DONE;
+    }
+    // Headers that don't fit in the buffer are refused rather than grown into
+    if (parser.length == sizeof(parser.buffer) && parser.start == 0)
+    {
+        return PARSE_ERROR;
+    }
+    return PARSE_INCOMPLETE;
+}
+
+string_view findHeader(const HttpRequest &request, string_view name)
+{
+    for (size_t i = 0; i < request.headerCount; i++)
+    {
+        const HttpHeader &header = request.headers[i];
+        if (header.name.size() == name.size() && strncasecmp(header.name.data(), name.data(), name.size()) == 0)
+        {
+            return header.value;
+        }
+    }
+    return string_view();
+}
+
+//**************************************************************************************
+//* trim()
+//* - The value without spaces or tabs at either end.
+//**************************************************************************************
+static string_view trim(string_view value)
+{
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+    {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+//**************************************************************************************
+//* sameToken()
+//* - Compares two tokens without regard to case.
+//**************************************************************************************
+static bool sameToken(string_view first, string_view second)
+{
+    return first.size() == second.size() && strncasecmp(first.data(), second.data(), first.size()) == 0;
+}
+
+bool headerHasToken(string_view value, string_view token)
+{
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        if (sameToken(trim(value.substr(0, comma)), token))
+        {
+            return true;
+        }
+        if (comma == string_view::npos)
+        {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+//**************************************************************************************
+//* zeroWeight()
+//* - True if the parameters after a coding give it q=0, which turns it down.
+//**************************************************************************************
+static bool zeroWeight(string_view parameters)
+{
+    parameters = trim(parameters);
+    return parameters.size() >= 3 && (parameters[0] == 'q' || parameters[0] == 'Q') && parameters[1] == '=' &&
+           parameters.substr(2).find_first_not_of("0.") == string_view::npos;
+}
+
+bool acceptsEncoding(string_view acceptEncoding, string_view coding)
+{
+    //The coding named outright wins over *, wherever they are in the list
+    bool starAccepted = false;
+    while (!acceptEncoding.empty())
+    {
+        size_t comma = acceptEncoding.find(',');
+        string_view item = acceptEncoding.substr(0, comma);
+        size_t semicolon = item.find(';');
+        string_view name = trim(item.substr(0, semicolon));
+        bool refused = semicolon != string_view::npos && zeroWeight(item.substr(semicolon + 1));
+        if (sameToken(name, coding))
+        {
+            return !refused;
+        }
+        if (name == "*")
+        {
+            starAccepted = !refused;
+        }
+        if (comma == string_view::npos)
+        {
+            break;
+        }
+        acceptEncoding.remove_prefix(comma + 1);
+    }
+    return starAccepted;
+}
+
+string formatHttpDate(time_t when)
+{
+    struct tm fields;
+    char date[40];
+    gmtime_r(&when, &fields);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &fields);
+    return date;
+}
+
+bool parseHttpDate(string_view date, time_t &when)
+{
+    //strptime() wants a terminated string, and a valid date is always short
+    char text[40];
+    if (date.size() >= sizeof(text))
+    {
+        return false;
+    }
+    memcpy(text, date.data(), date.size());
+    text[date.size()] = '\0';
+
+    struct tm fields;
+    memset(&fields, 0, sizeof(fields));
+    const char *end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &fields);
+    if (end == NULL || *end != '\0')
+    {
+        return false;
+    }
+    when = timegm(&fields);
+    return true;
+}
+
+bool etagMatches(string_view ifNoneMatch, string_view etag)
+{
+    if (trim(ifNoneMatch) == "*")
+    {
+        return true;
+    }
+    if (etag.substr(0, 2) == "W/")
+    {
+        etag.remove_prefix(2);
+    }
+    while (!ifNoneMatch.empty())
+    {
+        size_t comma = ifNoneMatch.find(',');
+        string_view tag = trim(ifNoneMatch.substr(0, comma));
+        if (tag.substr(0, 2) == "W/")
+        {
+            tag.remove_prefix(2);
+        }
+        if (tag == etag)
+        {
+            return true;
+        }
+        if (comma == string_view::npos)
+        {
+            break;
+        }
+        ifNoneMatch.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+//**************************************************************************************
+//* parseOffset()
+//* - A run of digits as a file offset. Returns false if there are none, anything else
+//*   is in the way, or the number is too big for an off_t.
+//**************************************************************************************
+static bool parseOffset(string_view digits, off_t &offset)
+{
+    if (digits.empty() || digits.size() > 18)
+    {
+        return false;
+    }
+    offset = 0;
+    for (char c : digits)
+    {
+        if (c < '0' || c > '9')
+        {
+            return false;
+        }
+        offset = offset * 10 + (c - '0');
+    }
+    return true;
+}
+
+RangeResult parseRange(string_view value, off_t size, RangeSet &ranges)
+{
+    ranges.count = 0;
+    value = trim(value);
+    if (value.size() < 6 || strncasecmp(value.data(), "bytes=", 6) != 0)
+    {
+        return RANGE_NONE;
+    }
+    value.remove_prefix(6);
+
+    bool anyRange = false;
+    while (true)
+    {
+        size_t comma = value.find(',');
+        string_view item = trim(value.substr(0, comma));
+        size_t dash = item.find('-');
+        //Empty list items are allowed; anything else needs a dash
+        if (!item.empty())
+        {
+            if (dash == string_view::npos)
+            {
+                return RANGE_NONE;
+            }
+            string_view firstDigits = trim(item.substr(0, dash));
+            string_view lastDigits = trim(item.substr(dash + 1));
+            off_t first;
+            off_t last;
+            if (firstDigits.empty())
+            {
+                //A suffix range: the last so many bytes
+                if (!parseOffset(lastDigits, last))
+                {
+                    return RANGE_NONE;
+                }
+                first = last < size ? size - last : 0;
+                last = last == 0 ? -1 : size - 1;
+            }
+            else
+            {
+                if (!parseOffset(firstDigits, first))
+                {
+                    return RANGE_NONE;
+                }
+                if (lastDigits.empty())
+                {
+                    last = size - 1;
+                }
+                else if (!parseOffset(lastDigits, last) || last < first)
+                {
+                    return RANGE_NONE;
+                }
+                if (last >= size)
+                {
+                    last = size - 1;
+                }
+            }
+
+            anyRange = true;
+            if (first < size && first <= last)
+            {
+                if (ranges.count == kMaxRanges)
+                {
+                    return RANGE_NONE;
+                }
+                ranges.ranges[ranges.count].first = first;
+                ranges.ranges[ranges.count].last = last;
+                ranges.count++;
+            }
+        }
+        if (comma == string_view::npos)
+        {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+
+    if (!anyRange)
+    {
+        return RANGE_NONE;
+    }
+    return ranges.count > 0 ? RANGE_SATISFIABLE : RANGE_NOT_SATISFIABLE;
+}
@@ -0,0 +1,192 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+//********************************************************
+//* Incremental HTTP request parser.
+//*
+//* The caller reads straight into the parser's buffer and
+//* calls parseRequest() after every read. The parser is a
+//* state machine over the request line and headers that
+//* picks up where it left off, so every byte is looked at
+//* once however the request is split up, and nothing is
+//* ever allocated. A finished request is handed back as
+//* string_views into the buffer.
+//*
+//* Requests pipelined on one connection follow each other
+//* in the buffer. nextRequest() starts on the one after a
+//* finished request without moving any bytes; the buffer
+//* is only compacted when a read needs the room.
+//********************************************************
+static const size_t kRequestBufferSize = 8192;
+static const size_t kMaxHeaders = 32;
+static const size_t kMaxRanges = 16;
+
+enum ParseResult
+{
+    PARSE_INCOMPLETE,
+    PARSE_DONE,
+    PARSE_ERROR
+};
+
+enum RequestState
+{
+    STATE_METHOD,
+    STATE_TARGET,
+    STATE_VERSION,
+    STATE_REQUEST_LINE_LF,
+    STATE_HEADER_START,
+    STATE_HEADER_NAME,
+    STATE_HEADER_VALUE,
+    STATE_HEADER_LF,
+    STATE_END_LF,
+    STATE_DONE
+};
+
+//********************************************************
+//* The byte ranges a Range header asks for, first and last
+//* byte inclusive, clamped to the size of the file.
+//********************************************************
+struct ByteRange
+{
+    off_t first;
+    off_t last;
+};
+
+struct RangeSet
+{
+    ByteRange ranges[kMaxRanges];
+    size_t count;
+};
+
+enum RangeResult
+{
+    // No usable Range header; the whole file is sent
+    RANGE_NONE,
+    RANGE_SATISFIABLE,
+    RANGE_NOT_SATISFIABLE
+};
+
+struct HttpHeader
+{
+    std::string_view name;
+    std::string_view value;
+};
+
+struct HttpRequest
+{
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    HttpHeader headers[kMaxHeaders];
+    size_t headerCount;
+};
+
+//********************************************************
+//* Where each part of the request is in the buffer, kept
+//* as offsets while parsing.
+//********************************************************
+struct HeaderOffsets
+{
+    size_t nameStart;
+    size_t nameEnd;
+    size_t valueStart;
+    size_t valueEnd;
+};
+
+struct RequestParser
+{
+    char buffer[kRequestBufferSize];
+    // Bytes read into buffer, and how many of them have been parsed
+    size_t length;
+    size_t parsed;
+    // Where the request being parsed starts; bytes before it are from requests
+    // already answered
+    size_t start;
+    RequestState state;
+    size_t methodEnd;
+    size_t targetStart;
+    size_t targetEnd;
+    size_t versionStart;
+    size_t versionEnd;
+    HeaderOffsets headers[kMaxHeaders];
+    size_t headerCount;
+};
+
+void initRequestParser(RequestParser &parser);
+
+//**************************************************************************************
+//* nextRequest()
+//* - Moves on to the request after the one just parsed, which may already be partly
+//*   or wholly in the buffer.
+//**************************************************************************************
+void nextRequest(RequestParser &parser);
+
+//**************************************************************************************
+//* compactRequestBuffer()
+//* - Moves the request being parsed to the front of the buffer to make room for the
+//*   next read. Views from an earlier parseRequest() are no longer valid after it.
+//**************************************************************************************
+void compactRequestBuffer(RequestParser &parser);
+
+//**************************************************************************************
+//* parseRequest()
+//* - Parses the bytes read since the last call. Returns PARSE_DONE and fills in request
+//*   once the blank line ending the headers has been read; parser.parsed is then where
+//*   the request's body, or the next request, starts in the buffer.
+//* - Returns PARSE_ERROR for a malformed request, or one whose headers don't fit in
+//*   the buffer or number more than kMaxHeaders. A full buffer that still holds bytes
+//*   of earlier requests is PARSE_INCOMPLETE; compacting it makes room.
+//**************************************************************************************
+ParseResult parseRequest(RequestParser &parser, HttpRequest &request);
+
+//**************************************************************************************
+//* findHeader()
+//* - The value of the named header, compared without regard to case, or an empty view.
+//**************************************************************************************
+std::string_view findHeader(const HttpRequest &request, std::string_view name);
+
+//**************************************************************************************
+//* headerHasToken()
+//* - True if a comma separated header value, like Connection's, lists token, compared
+//*   without regard to case.
+//**************************************************************************************
+bool headerHasToken(std::string_view value, std::string_view token);
+
+//**************************************************************************************
+//* acceptsEncoding()
+//* - True if an Accept-Encoding value lists coding, or *, without a q of zero.
+//**************************************************************************************
+bool acceptsEncoding(std::string_view acceptEncoding, std::string_view coding);
+
+//**************************************************************************************
+//* formatHttpDate() / parseHttpDate()
+//* - Convert between a time and the date format HTTP headers use, like
+//*   "Sun, 06 Nov 1994 08:49:37 GMT". parseHttpDate() returns false for anything else.
+//**************************************************************************************
+std::string formatHttpDate(time_t when);
+bool parseHttpDate(std::string_view date, time_t &when);
+
+//**************************************************************************************
+//* etagMatches()
+//* - True if an If-None-Match value is * or lists etag. W/ prefixes are ignored, as
+//*   If-None-Match compares tags weakly.
+//**************************************************************************************
+bool etagMatches(std::string_view ifNoneMatch, std::string_view etag);
+
+//**************************************************************************************
+//* parseRange()
+//* - Works out the byte ranges a Range value asks for in a file of size bytes. Ranges
+//*   starting past the end are dropped, and if that leaves none the result is
+//*   RANGE_NOT_SATISFIABLE.
+//* - A value that isn't bytes=, is malformed, or lists more than kMaxRanges ranges is
+//*   ignored, which is RANGE_NONE, as RFC 7233 allows.
+//**************************************************************************************
+RangeResult parseRange(std::string_view value, off_t size, RangeSet &ranges);
+
+#endif
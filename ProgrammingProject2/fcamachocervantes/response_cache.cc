@@ -0,0 +1,452 @@
+#include "response_cache.h"
+#include "web_server.h"
+#include <cstdio>
+#include <sys/inotify.h>
+#include <zlib.h>
+
+using namespace std;
+
+void initResponseCache(ResponseCache &cache, size_t capacity)
+{
+    cache.bytes = 0;
+    cache.capacity = capacity;
+    cache.inotifyFD = -1;
+    cache.changes = 0;
+    cache.hits = 0;
+    cache.misses = 0;
+    cache.evictions = 0;
+    cache.invalidations = 0;
+    if (capacity == 0)
+    {
+        return;
+    }
+
+    //Without the watch, entries could go stale, so the cache is turned off instead
+    cache.inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotifyFD == -1 ||
+        inotify_add_watch(cache.inotifyFD, ".", IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM |
+                                                    IN_MOVED_TO | IN_DELETE | IN_CREATE) == -1)
+    {
+        perror("inotify");
+        cout << "Response cache disabled" << endl;
+        if (cache.inotifyFD != -1)
+        {
+            close(cache.inotifyFD);
+            cache.inotifyFD = -1;
+        }
+        cache.capacity = 0;
+    }
+}
+
+//**************************************************************************************
+//* entrySize()
+//* - The bytes an entry counts against the cap.
+//**************************************************************************************
+static size_t variantSize(const ResponseVariant &variant)
+{
+    return variant.header.size() + variant.notModifiedHeader.size() + variant.body.size() +
+           variant.validators.etag.size();
+}
+
+static size_t entrySize(const CachedResponse &response)
+{
+    return variantSize(response.identity) + variantSize(response.gzip);
+}
+
+//**************************************************************************************
+//* removeEntry()
+//* - Drops a file's entry, if it has one.
+//**************************************************************************************
+static bool removeEntry(ResponseCache &cache, const string &fileName)
+{
+    auto found = cache.entries.find(fileName);
+    if (found == cache.entries.end())
+    {
+        return false;
+    }
+    cache.bytes -= entrySize(*found->second.response);
+    cache.lru.erase(found->second.used);
+    cache.entries.erase(found);
+    return true;
+}
+
+//**************************************************************************************
+//* processCacheEvents()
+//* - Drops the entry of every file named, and of the file a changed .gz belongs to. If
+//*   events were lost, nothing in the cache can be trusted and all of it goes.
+//* - The events are read before the lock is taken, so lookups only wait for the entries
+//*   to be dropped.
+//**************************************************************************************
+void processCacheEvents(ResponseCache &cache)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        ssize_t bytesRead = read(cache.inotifyFD, events, sizeof(events));
+        if (bytesRead <= 0)
+        {
+            return;
+        }
+        lock_guard<mutex> guard(cache.lock);
+        cache.changes++;
+        for (char *next = events; next < events + bytesRead;)
+        {
+            struct inotify_event *event = (struct inotify_event *)next;
+            next += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                cache.invalidations += cache.entries.size();
+                cache.entries.clear();
+                cache.lru.clear();
+                cache.bytes = 0;
+            }
+            else if (event->len > 0)
+            {
+                string fileName = event->name;
+                if (fileName.size() > 3 && fileName.compare(fileName.size() - 3, 3, ".gz") == 0)
+                {
+                    fileName.resize(fileName.size() - 3);
+                }
+                if (removeEntry(cache, fileName))
+                {
+                    DEBUG << "File " << event->name << " changed, dropped " << fileName << " from the cache" << ENDL;
+                    cache.invalidations++;
+                }
+            }
+        }
+    }
+}
+
+//**************************************************************************************
+//* readFile()
+//* - Reads a whole regular file of at most limit bytes into contents, and its stat()
+//*   data into fileStat. Returns false if it can't.
+//**************************************************************************************
+static bool readFile(const string &fileName, size_t limit, string &contents, struct stat &fileStat)
+{
+    int fileFD = open(fileName.c_str(), O_RDONLY);
+    if (fileFD == -1)
+    {
+        return false;
+    }
+    if (fstat(fileFD, &fileStat) == -1 || !S_ISREG(fileStat.st_mode) || (size_t)fileStat.st_size > limit)
+    {
+        close(fileFD);
+        return false;
+    }
+
+    contents.resize(fileStat.st_size);
+    size_t length = 0;
+    while (length < contents.size())
+    {
+        ssize_t bytesRead = read(fileFD, &contents[length], contents.size() - length);
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead == -1)
+        {
+            perror("read");
+            close(fileFD);
+            return false;
+        }
+        if (bytesRead == 0)
+        {
+            //The file got shorter since fstat(); inotify will drop what's cached here
+            break;
+        }
+        length += bytesRead;
+    }
+    close(fileFD);
+    contents.resize(length);
+    return true;
+}
+
+//**************************************************************************************
+//* isCompressible()
+//* - True for the files worth sending gzip encoded. JPEGs are already compressed.
+//**************************************************************************************
+static bool isCompressible(const string &fileName)
+{
+    size_t dotPosition = fileName.find_last_of(".");
+    if (dotPosition == string::npos)
+    {
+        return false;
+    }
+    string extension = fileName.substr(dotPosition + 1);
+    return extension == "html" || extension == "htm";
+}
+
+//**************************************************************************************
+//* gzipCompress()
+//* - Compresses data into a gzip stream. It is done on a request's miss, so it uses
+//*   zlib's default level, which is most of the best level's saving for a fraction of
+//*   the time. Returns false if zlib fails.
+//**************************************************************************************
+static bool gzipCompress(const string &data, string &compressed)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    //16 more window bits asks for a gzip header and trailer rather than zlib's own
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+    compressed.resize(deflateBound(&stream, data.size()));
+    stream.next_in = (Bytef *)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = (Bytef *)&compressed[0];
+    stream.avail_out = compressed.size();
+    int result = deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+//**************************************************************************************
+//* fillVariant()
+//* - Sets up one variant of a cached response, headers and all.
+//**************************************************************************************
+static void fillVariant(ResponseVariant &variant, const string &fileName, string body, const Validators &validators,
+                        bool gzip)
+{
+    variant.body = move(body);
+    variant.validators = validators;
+    variant.header = responseHeader(fileName, variant.body.size(), validators, gzip);
+    variant.notModifiedHeader = notModifiedHeader(fileName, validators);
+}
+
+//**************************************************************************************
+//* loadGzipVariant()
+//* - Fills in the gzip variant of an HTML file, from its .gz sibling if that is up to
+//*   date, or by compressing it. Left empty if compressing doesn't make it smaller.
+//**************************************************************************************
+static void loadGzipVariant(ResponseCache &cache, const string &fileName, const struct stat &fileStat,
+                            CachedResponse &response)
+{
+    string compressed;
+    struct stat gzipStat;
+    Validators validators;
+    if (readFile(fileName + ".gz", cache.capacity, compressed, gzipStat) && gzipStat.st_mtime >= fileStat.st_mtime)
+    {
+        DEBUG << "Using " << fileName << ".gz for gzip responses" << ENDL;
+        validators = fileValidators(gzipStat, "-gz");
+    }
+    else if (gzipCompress(response.identity.body, compressed))
+    {
+        validators = fileValidators(fileStat, "-gz");
+    }
+    else
+    {
+        cout << "Could not compress " << fileName << endl;
+        return;
+    }
+    if (compressed.size() >= response.identity.body.size())
+    {
+        return;
+    }
+    fillVariant(response.gzip, fileName, move(compressed), validators, true);
+}
+
+//**************************************************************************************
+//* loadResponse()
+//* - Reads a whole file into a new response. Called without the cache's lock; only the
+//*   capacity, which never changes, is looked at. Returns NULL if the file can't be
+//*   read or won't fit.
+//**************************************************************************************
+static shared_ptr<const CachedResponse> loadResponse(ResponseCache &cache, const string &fileName)
+{
+    auto response = make_shared<CachedResponse>();
+    struct stat fileStat;
+    string body;
+    if (!readFile(fileName, cache.capacity, body, fileStat))
+    {
+        return NULL;
+    }
+    fillVariant(response->identity, fileName, move(body), fileValidators(fileStat), false);
+    if (isCompressible(fileName))
+    {
+        loadGzipVariant(cache, fileName, fileStat, *response);
+    }
+    if (entrySize(*response) > cache.capacity)
+    {
+        return NULL;
+    }
+    return response;
+}
+
+//**************************************************************************************
+//* insertEntry()
+//* - Adds a loaded response to the cache, evicting the least recently used entries to
+//*   make room. Called with the cache's lock held.
+//**************************************************************************************
+static void insertEntry(ResponseCache &cache, const string &fileName, const shared_ptr<const CachedResponse> &response)
+{
+    size_t size = entrySize(*response);
+    while (cache.bytes + size > cache.capacity)
+    {
+        DEBUG << "Evicting " << cache.lru.back() << " from the cache" << ENDL;
+        removeEntry(cache, cache.lru.back());
+        cache.evictions++;
+    }
+
+    cache.lru.push_front(fileName);
+    CacheEntry &entry = cache.entries[fileName];
+    entry.response = response;
+    entry.used = cache.lru.begin();
+    cache.bytes += size;
+}
+
+shared_ptr<const CachedResponse> lookupResponse(ResponseCache &cache, const string &fileName)
+{
+    if (cache.capacity == 0)
+    {
+        return NULL;
+    }
+    unsigned long changes = 0;
+    {
+        lock_guard<mutex> guard(cache.lock);
+        auto found = cache.entries.find(fileName);
+        if (found != cache.entries.end())
+        {
+            cache.hits++;
+            cache.lru.splice(cache.lru.begin(), cache.lru, found->second.used);
+            return found->second.response;
+        }
+        cache.misses++;
+        changes = cache.changes;
+    }
+
+    shared_ptr<const CachedResponse> response = loadResponse(cache, fileName);
+    if (!response)
+    {
+        return NULL;
+    }
+    lock_guard<mutex> guard(cache.lock);
+    //Another worker may have loaded the same file in the meantime
+    auto found = cache.entries.find(fileName);
+    if (found != cache.entries.end())
+    {
+        cache.lru.splice(cache.lru.begin(), cache.lru, found->second.used);
+        return found->second.response;
+    }
+    //An event read since the load began may have been for this file, and dropped nothing
+    //because there was nothing cached yet
+    if (cache.changes == changes)
+    {
+        insertEntry(cache, fileName, response);
+    }
+    return response;
+}
+
+Validators fileValidators(const struct stat &fileStat, const char *suffix)
+{
+    char etag[80];
+    unsigned long long modified = (unsigned long long)fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx%s\"", (unsigned long long)fileStat.st_ino,
+             (unsigned long long)fileStat.st_size, modified, suffix);
+    Validators validators;
+    validators.etag = etag;
+    validators.lastModified = fileStat.st_mtime;
+    return validators;
+}
+
+//**************************************************************************************
+//* validatorHeaders()
+//* - The headers every 200 and 304 response for the file carries.
+//**************************************************************************************
+static string validatorHeaders(const string &fileName, const Validators &validators, bool vary)
+{
+    string headers = "ETag: " + validators.etag + "\r\n";
+    headers += "Last-Modified: " + formatHttpDate(validators.lastModified) + "\r\n";
+    if (vary && isCompressible(fileName))
+    {
+        headers += "Vary: Accept-Encoding\r\n";
+    }
+    return headers;
+}
+
+string responseHeader(const string &fileName, off_t length, const Validators &validators, bool gzip, bool vary)
+{
+    //Construct the HTTP response header with status line, content-type, and content-length
+    string header = "HTTP/1.1 200 OK\r\n";
+    header += "Content-Type: " + string(contentType(fileName)) + "\r\n";
+    header += "Content-Length: " + to_string(length) + "\r\n";
+    header += "Accept-Ranges: bytes\r\n";
+    if (gzip)
+    {
+        header += "Content-Encoding: gzip\r\n";
+    }
+    header += validatorHeaders(fileName, validators, vary);
+    return header;
+}
+
+//**************************************************************************************
+//* contentRange()
+//* - The Content-Range value for one range of a file.
+//**************************************************************************************
+static string contentRange(const ByteRange &range, off_t size)
+{
+    return "bytes " + to_string(range.first) + "-" + to_string(range.last) + "/" + to_string(size);
+}
+
+PartialResponse partialResponse(const string &fileName, off_t size, const Validators &validators,
+                                const RangeSet &ranges, bool vary)
+{
+    PartialResponse partial;
+    off_t length = 0;
+    partial.header = "HTTP/1.1 206 Partial Content\r\n";
+    if (ranges.count == 1)
+    {
+        length = ranges.ranges[0].last - ranges.ranges[0].first + 1;
+        partial.header += "Content-Type: " + string(contentType(fileName)) + "\r\n";
+        partial.header += "Content-Range: " + contentRange(ranges.ranges[0], size) + "\r\n";
+    }
+    else
+    {
+        //The boundary only has to stay out of the parts' headers and data; the ETag's
+        //hex digits, after a prefix no file starts with, make that near enough certain
+        string boundary = "web_server_byteranges_" + validators.etag.substr(1, validators.etag.size() - 2);
+        for (size_t i = 0; i < ranges.count; i++)
+        {
+            string partHeader = "\r\n--" + boundary + "\r\n";
+            partHeader += "Content-Type: " + string(contentType(fileName)) + "\r\n";
+            partHeader += "Content-Range: " + contentRange(ranges.ranges[i], size) + "\r\n\r\n";
+            length += partHeader.size() + ranges.ranges[i].last - ranges.ranges[i].first + 1;
+            partial.partHeaders.push_back(partHeader);
+        }
+        partial.trailer = "\r\n--" + boundary + "--\r\n";
+        length += partial.trailer.size();
+        partial.header += "Content-Type: multipart/byteranges; boundary=" + boundary + "\r\n";
+    }
+    partial.header += "Content-Length: " + to_string(length) + "\r\n";
+    partial.header += validatorHeaders(fileName, validators, vary);
+    return partial;
+}
+
+string notSatisfiableHeader(off_t size)
+{
+    string header = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    header += "Content-Range: bytes */" + to_string(size) + "\r\n";
+    header += "Content-Length: 0\r\n";
+    return header;
+}
+
+string notModifiedHeader(const string &fileName, const Validators &validators, bool vary)
+{
+    return "HTTP/1.1 304 Not Modified\r\n" + validatorHeaders(fileName, validators, vary);
+}
+
+string cacheStats(const ResponseCache &cache)
+{
+    lock_guard<mutex> guard(cache.lock);
+    ostringstream stats;
+    stats << "hits " << cache.hits << "\n";
+    stats << "misses " << cache.misses << "\n";
+    stats << "evictions " << cache.evictions << "\n";
+    stats << "invalidations " << cache.invalidations << "\n";
+    stats << "entries " << cache.entries.size() << "\n";
+    stats << "bytes " << cache.bytes << "\n";
+    stats << "capacity " << cache.capacity << "\n";
+    return stats.str();
+}
@@ -0,0 +1,182 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "http_request.h"
+#include "router.h"
+
+//********************************************************
+//* Cache of whole 200 responses, keyed by file name.
+//*
+//* An entry holds the response header, already serialized,
+//* and a copy of the file, so a hit is answered with one
+//* writev() and no stat(), open() or read(). Entries are
+//* shared, so a response queued to be sent stays valid if
+//* its entry is evicted before it goes out. The files
+//* served all live in the server's directory, which is
+//* watched with inotify; any change to a file there drops
+//* its entry, and the next request loads it again.
+//*
+//* The header and body bytes of all entries are kept under
+//* a cap. When a new entry would go over it, the least
+//* recently used entries are evicted first. A file bigger
+//* than the whole cap is never cached.
+//*
+//* HTML is also kept gzip encoded for clients that accept
+//* it. A file.html.gz next to file.html, and no older than
+//* it, is used as is; otherwise the file is compressed when
+//* it is loaded. Both variants count against the cap.
+//*
+//* Each variant's ETag and Last-Modified, and the headers
+//* of its 304 response, are worked out once at load time.
+//*
+//* Every worker shares the one cache, behind one lock. A
+//* hit is a map lookup under it and nothing more: the
+//* inotify fd is watched by a reactor, which drops changed
+//* entries as soon as their events arrive. A miss reads and
+//* compresses the file without the lock, so other workers
+//* are never held up by a cold file.
+//********************************************************
+static const size_t kDefaultCacheSize = 16 * 1024 * 1024;
+static const char *const kCacheStatsName = "cache-stats";
+
+//********************************************************
+//* What a conditional request is checked against. The ETag
+//* is strong, made from the inode, size and modification
+//* time, so any change to the file changes it.
+//********************************************************
+struct Validators
+{
+    std::string etag;
+    time_t lastModified;
+};
+
+struct ResponseVariant
+{
+    // Status lines and headers, up to but not including the Connection header
+    std::string header;
+    std::string notModifiedHeader;
+    std::string body;
+    Validators validators;
+};
+
+struct CachedResponse
+{
+    ResponseVariant identity;
+    // Empty unless the file is HTML and compressing it helps
+    ResponseVariant gzip;
+};
+
+struct CacheEntry
+{
+    std::shared_ptr<const CachedResponse> response;
+    // Where the entry is in the cache's LRU list
+    std::list<std::string>::iterator used;
+};
+
+struct ResponseCache
+{
+    mutable std::mutex lock;
+    std::unordered_map<std::string, CacheEntry> entries;
+    // File names, most recently used first
+    std::list<std::string> lru;
+    size_t bytes;
+    size_t capacity;
+    int inotifyFD;
+    // Counts batches of inotify events, so a load can tell that files changed while it
+    // was reading them
+    unsigned long changes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+};
+
+//**************************************************************************************
+//* initResponseCache()
+//* - Sets up an empty cache holding at most capacity bytes and starts watching the
+//*   current directory. A capacity of 0 turns the cache off.
+//**************************************************************************************
+void initResponseCache(ResponseCache &cache, size_t capacity);
+
+//**************************************************************************************
+//* processCacheEvents()
+//* - Reads whatever inotify has queued on cache.inotifyFD and drops the entries of the
+//*   files it names. Called whenever the fd is readable.
+//**************************************************************************************
+void processCacheEvents(ResponseCache &cache);
+
+//**************************************************************************************
+//* lookupResponse()
+//* - The cached response for fileName, loading the file on a miss. Returns NULL if the
+//*   file can't be read or is too big to cache, in which case the caller serves it
+//*   from disk. A file that changed while it was loaded is served but not cached.
+//**************************************************************************************
+std::shared_ptr<const CachedResponse> lookupResponse(ResponseCache &cache, const std::string &fileName);
+
+//**************************************************************************************
+//* fileValidators()
+//* - The validators of a file from its stat() data. suffix tells apart the ETags of
+//*   other encodings made from the same file.
+//**************************************************************************************
+Validators fileValidators(const struct stat &fileStat, const char *suffix = "");
+
+//**************************************************************************************
+//* responseHeader()
+//* - The status line and headers of a 200 response for a file of the given length,
+//*   without the Connection header or the blank line that ends them. gzip marks the
+//*   body as gzip encoded. Files that can have a gzip variant say that responses vary
+//*   with Accept-Encoding, whichever variant is sent, unless vary is false because
+//*   they are never served gzip encoded.
+//**************************************************************************************
+std::string responseHeader(const std::string &fileName, off_t length, const Validators &validators,
+                           bool gzip = false, bool vary = true);
+
+//********************************************************
+//* The parts of a 206 response other than the file's own
+//* bytes. A multipart/byteranges response puts a part
+//* header before each range and a trailer after the last.
+//********************************************************
+struct PartialResponse
+{
+    std::string header;
+    std::vector<std::string> partHeaders;
+    std::string trailer;
+};
+
+//**************************************************************************************
+//* partialResponse()
+//* - The headers of a 206 response carrying the ranges of a file of the given size,
+//*   as one range or as multipart/byteranges. vary is as for responseHeader().
+//**************************************************************************************
+PartialResponse partialResponse(const std::string &fileName, off_t size, const Validators &validators,
+                                const RangeSet &ranges, bool vary = true);
+
+//**************************************************************************************
+//* notSatisfiableHeader()
+//* - The status line and headers of a 416 response for a file of the given size.
+//**************************************************************************************
+std::string notSatisfiableHeader(off_t size);
+
+//**************************************************************************************
+//* notModifiedHeader()
+//* - The status line and headers of a 304 response for the file. vary is as for
+//*   responseHeader().
+//**************************************************************************************
+std::string notModifiedHeader(const std::string &fileName, const Validators &validators, bool vary = true);
+
+//**************************************************************************************
+//* cacheStats()
+//* - The counters and size of the cache as lines of text.
+//**************************************************************************************
+std::string cacheStats(const ResponseCache &cache);
+
+#endif
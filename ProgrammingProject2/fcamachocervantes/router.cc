@@ -0,0 +1,187 @@
+#include "router.h"
+#include "web_server.h"
+#include <algorithm>
+#include <cstdio>
+#include <dirent.h>
+
+using namespace std;
+
+//Give up on a bucket after this many seeds and try again with more slots
+static const uint32_t kMaxSeed = 1 << 16;
+
+//**************************************************************************************
+//* routeHash()
+//* - FNV-1a of the name, started from the seed so each seed gives a different hash.
+//**************************************************************************************
+static uint32_t routeHash(uint32_t seed, string_view name)
+{
+    uint32_t hash = 2166136261u ^ (seed * 16777619u);
+    for (char c : name)
+    {
+        hash ^= (unsigned char)c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//**************************************************************************************
+//* placeRoutes()
+//* - Tries to lay the routes out with the given number of slots. Buckets are placed
+//*   biggest first, each with the first seed that sends all of its names to free slots.
+//* - Returns false if some bucket has no such seed.
+//**************************************************************************************
+static bool placeRoutes(RouteTable &table, const vector<Route> &routes, size_t slotCount)
+{
+    size_t bucketCount = max<size_t>(1, routes.size() / 2);
+    vector<vector<const Route *>> buckets(bucketCount);
+    for (const Route &route : routes)
+    {
+        buckets[routeHash(0, route.fileName) % bucketCount].push_back(&route);
+    }
+    vector<size_t> order(bucketCount);
+    for (size_t i = 0; i < bucketCount; i++)
+    {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    table.slots.assign(slotCount, Route{"", NULL, NULL});
+    table.seeds.assign(bucketCount, 0);
+    vector<size_t> taken;
+    for (size_t bucket : order)
+    {
+        if (buckets[bucket].empty())
+        {
+            break;
+        }
+        uint32_t seed = 1;
+        for (; seed < kMaxSeed; seed++)
+        {
+            taken.clear();
+            for (const Route *route : buckets[bucket])
+            {
+                size_t slot = routeHash(seed, route->fileName) % slotCount;
+                if (!table.slots[slot].fileName.empty() || find(taken.begin(), taken.end(), slot) != taken.end())
+                {
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (taken.size() == buckets[bucket].size())
+            {
+                break;
+            }
+        }
+        if (seed == kMaxSeed)
+        {
+            return false;
+        }
+        table.seeds[bucket] = seed;
+        for (size_t i = 0; i < taken.size(); i++)
+        {
+            table.slots[taken[i]] = *buckets[bucket][i];
+        }
+    }
+    return true;
+}
+
+vector<string> servedFiles(const char *root)
+{
+    vector<string> fileNames;
+    DIR *directory = opendir(root);
+    if (directory == NULL)
+    {
+        perror("opendir");
+        return fileNames;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        //Only regular files; a symbolic link could lead out of the document root
+        struct stat fileStat;
+        if (entry->d_type == DT_UNKNOWN &&
+            fstatat(dirfd(directory), entry->d_name, &fileStat, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(fileStat.st_mode))
+        {
+            entry->d_type = DT_REG;
+        }
+        if (entry->d_type == DT_REG && contentType(entry->d_name) != NULL &&
+            requestPath(string("/") + entry->d_name) == entry->d_name)
+        {
+            fileNames.push_back(entry->d_name);
+        }
+    }
+    closedir(directory);
+    return fileNames;
+}
+
+size_t buildRouteTable(RouteTable &table, const vector<Route> &routes)
+{
+    //A quarter more slots than routes leaves the last buckets room to find a seed
+    size_t slotCount = max<size_t>(1, routes.size() + routes.size() / 4);
+    while (!placeRoutes(table, routes, slotCount))
+    {
+        slotCount *= 2;
+    }
+    return routes.size();
+}
+
+size_t buildRouteTable(RouteTable &table, const char *root)
+{
+    vector<Route> routes;
+    for (const string &fileName : servedFiles(root))
+    {
+        DEBUG << "Route for " << fileName << " as " << contentType(fileName) << ENDL;
+        routes.push_back(Route{fileName, contentType(fileName), NULL});
+    }
+    return buildRouteTable(table, routes);
+}
+
+string_view requestPath(string_view target)
+{
+    size_t end = target.find_first_of("?#");
+    if (end != string_view::npos)
+    {
+        target = target.substr(0, end);
+    }
+    //An absolute-form target starts with the scheme and host
+    if (target.substr(0, 7) == "http://")
+    {
+        size_t slash = target.find('/', 7);
+        target = slash == string_view::npos ? string_view() : target.substr(slash);
+    }
+    if (target.empty() || target.front() != '/' || target.find_first_of(string_view("\\\0", 2)) != string_view::npos)
+    {
+        return string_view();
+    }
+    string_view path = target.substr(1);
+
+    //Every segment must name something inside the one it is in
+    string_view rest = path;
+    while (true)
+    {
+        size_t slash = rest.find('/');
+        string_view segment = rest.substr(0, slash);
+        if (segment.empty() || segment == "." || segment == "..")
+        {
+            return string_view();
+        }
+        if (slash == string_view::npos)
+        {
+            return path;
+        }
+        rest = rest.substr(slash + 1);
+    }
+}
+
+const Route *findRoute(const RouteTable &table, string_view target)
+{
+    string_view path = requestPath(target);
+    if (path.empty() || table.seeds.empty())
+    {
+        return NULL;
+    }
+    uint32_t seed = table.seeds[routeHash(0, path) % table.seeds.size()];
+    const Route &route = table.slots[routeHash(seed, path) % table.slots.size()];
+    return seed != 0 && route.fileName == path ? &route : NULL;
+}
@@ -0,0 +1,128 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//********************************************************
+//* The files the server hands out.
+//*
+//* The route table is built once at startup from the
+//* regular files in the document root that have a known
+//* content type, and never changes after that. It is a
+//* perfect hash: every name is hashed into a bucket, and
+//* each bucket has a seed, picked at build time, that
+//* sends its names to slots no other name uses. A lookup
+//* is two hashes of the path and one comparison, so a
+//* request either names a route exactly or gets nothing.
+//*
+//* Paths are checked before they are looked up; a path
+//* with a "." or ".." segment, an empty segment, a
+//* backslash or a NUL never matches.
+//*
+//* The document root is a directory of its own, www in
+//* the working directory unless -d says otherwise, so
+//* nothing from the source tree is ever served.
+//********************************************************
+static const char *const kDefaultDocumentRoot = "www";
+
+struct MimeType
+{
+    std::string_view extension;
+    const char *type;
+};
+
+static constexpr MimeType kMimeTypes[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"txt", "text/plain"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"pdf", "application/pdf"},
+};
+
+//**************************************************************************************
+//* contentType()
+//* - The MIME type for a file's extension, or NULL if the server doesn't serve that
+//*   kind of file.
+//**************************************************************************************
+constexpr const char *contentType(std::string_view fileName)
+{
+    size_t dot = fileName.rfind('.');
+    if (dot == std::string_view::npos)
+    {
+        return NULL;
+    }
+    std::string_view extension = fileName.substr(dot + 1);
+    for (const MimeType &mimeType : kMimeTypes)
+    {
+        if (mimeType.extension == extension)
+        {
+            return mimeType.type;
+        }
+    }
+    return NULL;
+}
+
+static_assert(contentType("file1.html") != NULL && contentType("image1.jpg") != NULL, "missing MIME types");
+static_assert(contentType("web_server.cc") == NULL && contentType("Makefile") == NULL, "unexpected MIME types");
+
+struct BundledFile;
+
+struct Route
+{
+    // The file's name relative to the document root, empty for an unused slot
+    std::string fileName;
+    const char *contentType;
+    // The file in the asset bundle, or NULL to serve it from the document root
+    const BundledFile *bundled;
+};
+
+struct RouteTable
+{
+    std::vector<Route> slots;
+    // The seed each bucket's names are hashed with to find their slots
+    std::vector<uint32_t> seeds;
+};
+
+//**************************************************************************************
+//* servedFiles()
+//* - The names of the regular files in root that have a content type. Symbolic links
+//*   and subdirectories are left out.
+//**************************************************************************************
+std::vector<std::string> servedFiles(const char *root);
+
+//**************************************************************************************
+//* buildRouteTable()
+//* - Fills the table with the given routes, or with a route for each of root's
+//*   servedFiles(). Returns the number of routes. No two routes may have the same
+//*   name; there is no table to put them in.
+//**************************************************************************************
+size_t buildRouteTable(RouteTable &table, const std::vector<Route> &routes);
+size_t buildRouteTable(RouteTable &table, const char *root);
+
+//**************************************************************************************
+//* findRoute()
+//* - The route for a request target's path, ignoring any query string, or NULL if the
+//*   path is unsafe or doesn't name a route exactly.
+//**************************************************************************************
+const Route *findRoute(const RouteTable &table, std::string_view target);
+
+//**************************************************************************************
+//* requestPath()
+//* - The path of a request target, without its query string or the leading "/", or
+//*   "" if the path is unsafe to look up.
+//**************************************************************************************
+std::string_view requestPath(std::string_view target);
+
+#endif
@@ -1,210 +1,839 @@
 #include "web_server.h"
+#include "http_request.h"
+#include "response_cache.h"
+#include "event_loop.h"
+#include "router.h"
+#include "bundle.h"
 #include <unistd.h>
 #include <iostream>
 #include <cstring>
 #include <ctime>
 #include <cstdlib>
-#include <regex>
-#include <fstream>
+#include <csignal>
+#include <climits>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 bool VERBOSE;
 using namespace std;
 
-int readRequest(int socketFD, string &fileName)
+ResponseCache responseCache;
+//The files in the document root or the bundle, built once at startup
+static RouteTable routeTable;
+//The asset bundle given with -B, if any
+static Bundle bundle;
+//The one thing served that isn't a file
+static const Route kStatsRoute = {kCacheStatsName, "text/plain", NULL};
+
+//Connections waiting to be accepted; -b changes it
+static const int kDefaultListenQueueLength = 1024;
+
+//Seconds an idle connection is kept open; 0 closes every connection after one response
+static const int kDefaultKeepAliveTimeout = 5;
+int keepAliveTimeout = kDefaultKeepAliveTimeout;
+
+//**************************************************************************************
+//* checkRequest()
+//* - Picks out the file a parsed request asks for.
+//* - Returns 200 with route set for a GET or HEAD whose path names a route exactly,
+//*   404 for a GET or HEAD that names no route, and 400 for any other method.
+//**************************************************************************************
+int checkRequest(const HttpRequest &request, const Route *&route)
 {
-    //Constant values 
-    regex endOfRequest("\\r\\n\\r\\n");
-    regex validFile(".*((file[0-9]\\.html)|(image[0-9]\\.jpg)).*");
-    regex validHead("GET");
-    string getRequest = "";
-    int returnCode = 400;
-    char buffer[10];
-
-    //Reading all buffer data
-    while (true)
+    //Verbos debug showing the request line
+    DEBUG << "Request: " << request.method << " " << request.target << " " << request.version << ENDL;
+
+    if (request.method != "GET" && request.method != "HEAD")
+    {
+        return 400;
+    }
+    route = findRoute(routeTable, request.target);
+    if (route == NULL && requestPath(request.target) == kCacheStatsName)
     {
-        //Reading in data from the buffer and appending into one string
-        int bytesRead = recv(socketFD, buffer, sizeof(buffer), 0);
-        getRequest.append(buffer, bytesRead);
+        route = &kStatsRoute;
+    }
+    return route != NULL ? 200 : 404;
+}
+
+//**************************************************************************************
+//* wantsKeepAlive()
+//* - HTTP/1.1 connections stay open unless the client says to close them, and HTTP/1.0
+//*   ones close unless it asks for keep-alive.
+//* - A request with a body closes the connection too. The body is never read, so it
+//*   would be taken for the next request.
+//**************************************************************************************
+static bool wantsKeepAlive(const HttpRequest &request)
+{
+    string_view contentLength = findHeader(request, "Content-Length");
+    if ((!contentLength.empty() && contentLength != "0") || !findHeader(request, "Transfer-Encoding").empty())
+    {
+        return false;
+    }
+    string_view connection = findHeader(request, "Connection");
+    if (request.version == "HTTP/1.1")
+    {
+        return !headerHasToken(connection, "close");
+    }
+    return headerHasToken(connection, "keep-alive");
+}
+
+//********************************************************
+//* An open file a queued response sends its body from,
+//* closed once no response needs it.
+//********************************************************
+struct OpenFile
+{
+    explicit OpenFile(int fd) : fd(fd) {}
+    ~OpenFile() { close(fd); }
+    OpenFile(const OpenFile &) = delete;
+    OpenFile &operator=(const OpenFile &) = delete;
+    int fd;
+};
+
+//********************************************************
+//* A response waiting to be sent. Responses to requests
+//* that arrive together are queued and go out in one
+//* writev() once every request read so far is answered.
+//********************************************************
+struct Response
+{
+    // A response from the cache uses its header and body in place of these, or its
+    // gzip variant's if gzip is set
+    shared_ptr<const CachedResponse> cached;
+    bool gzip = false;
+    // A response from the bundle uses the file's header and body from the mapping
+    const BundledFile *bundled = NULL;
+    // Sends the cached 304 header instead, and no body
+    bool notModified = false;
+    string header;
+    string body;
+    // Leaves the body out, for a HEAD request
+    bool headOnly = false;
+    bool keepAlive = true;
+    // For a 206 from the cache or the bundle, the ranges of its identity body to send
+    // in place of all of it, each after its part header if there are several, then
+    // the trailer
+    RangeSet ranges = {};
+    vector<string> partHeaders;
+    string trailer;
+    // A body sent with sendfile() instead: fileLength bytes from fileOffset in fileFD,
+    // which openFile keeps open unless it is the bundle's
+    int fileFD = -1;
+    off_t fileOffset = 0;
+    off_t fileLength = 0;
+    shared_ptr<const OpenFile> openFile;
+};
+
+//********************************************************
+//* A connection's responses that haven't all gone out.
+//* When the client's socket buffer fills, what is left
+//* waits here and the connection waits for EPOLLOUT, so
+//* no worker is held up by a client that isn't reading.
+//********************************************************
+struct OutputQueue
+{
+    vector<Response> responses;
+    // Bytes of the first response already sent
+    off_t sent = 0;
+    // The connection closes once the queue is sent
+    bool closing = false;
+};
+
+void freeOutput(OutputQueue *output)
+{
+    delete output;
+}
+
+//The only fd the server has the reactors watch is the response cache's inotify fd
+void serveWatchEvents()
+{
+    processCacheEvents(responseCache);
+}
+
+static const size_t kMaxQueuedResponses = 64;
+static const char kKeepAliveEnd[] = "Connection: keep-alive\r\n\r\n";
+static const char kCloseEnd[] = "Connection: close\r\n\r\n";
+
+//Bodies from the bundle up to this size go out of the mapping with the rest of the
+//queue; bigger ones are sent with sendfile()
+static const size_t kInlineBodySize = 64 * 1024;
+
+//********************************************************
+//* A piece of the queued output: bytes in memory, or when
+//* data is NULL, length bytes of fileFD from offset.
+//********************************************************
+struct OutputPiece
+{
+    const char *data;
+    int fileFD;
+    off_t offset;
+    size_t length;
+};
 
-        //Breaking loop once \r\n\r\n is found
-        if (regex_search(getRequest, endOfRequest))
+//**************************************************************************************
+//* addPart()
+//* - Appends a piece of a response to the pieces being gathered, skipping empty ones.
+//**************************************************************************************
+static void addPart(vector<OutputPiece> &pieces, const char *data, size_t length)
+{
+    if (length > 0)
+    {
+        pieces.push_back(OutputPiece{data, -1, 0, length});
+    }
+}
+
+static void addPart(vector<OutputPiece> &pieces, string_view data)
+{
+    addPart(pieces, data.data(), data.size());
+}
+
+static void addFilePart(vector<OutputPiece> &pieces, int fileFD, off_t offset, off_t length)
+{
+    if (length > 0)
+    {
+        pieces.push_back(OutputPiece{NULL, fileFD, offset, (size_t)length});
+    }
+}
+
+//**************************************************************************************
+//* responsePieces()
+//* - Appends the pieces of one response: its header, the Connection header and blank
+//*   line, then its body, each from wherever it is kept. Returns the response's length.
+//**************************************************************************************
+static off_t responsePieces(const Response &response, vector<OutputPiece> &pieces)
+{
+    size_t first = pieces.size();
+    bool partial = response.ranges.count > 0;
+    string_view header = response.header;
+    string_view body = response.body;
+    if (response.cached)
+    {
+        const ResponseVariant &variant = response.gzip ? response.cached->gzip : response.cached->identity;
+        if (!partial)
         {
-            break;
+            header = response.notModified ? variant.notModifiedHeader : variant.header;
+        }
+        body = variant.body;
+    }
+    else if (response.bundled)
+    {
+        if (!partial)
+        {
+            header = response.notModified ? response.bundled->notModifiedHeader : response.bundled->header;
         }
+        body = response.bundled->body;
+    }
+    addPart(pieces, header);
+    if (response.keepAlive)
+    {
+        addPart(pieces, kKeepAliveEnd, sizeof(kKeepAliveEnd) - 1);
+    }
+    else
+    {
+        addPart(pieces, kCloseEnd, sizeof(kCloseEnd) - 1);
     }
 
-    //Verbos debug showing the HTTP header
-    DEBUG << "HTTP Header" << ENDL;
-    DEBUG << getRequest << ENDL;
-    
-    //Getting the name of file using regex
-    if (regex_search(getRequest, validHead))
+    if (!response.headOnly && !response.notModified && !partial)
     {
-        smatch match;
-        regex_search(getRequest, match, validFile);
-        fileName = match[1];
-        if (regex_search(fileName, validFile))
+        if (response.fileFD != -1)
         {
-            returnCode = 200;
-            return returnCode;
+            addFilePart(pieces, response.fileFD, response.fileOffset, response.fileLength);
         }
         else
         {
-            return returnCode;
+            addPart(pieces, body);
         }
     }
-    else
+    else if (!response.headOnly && !response.notModified)
     {
-        returnCode = 400;
-        return returnCode;
+        for (size_t i = 0; i < response.ranges.count; i++)
+        {
+            const ByteRange &range = response.ranges.ranges[i];
+            if (i < response.partHeaders.size())
+            {
+                addPart(pieces, response.partHeaders[i]);
+            }
+            if (response.fileFD != -1)
+            {
+                addFilePart(pieces, response.fileFD, response.fileOffset + range.first, range.last - range.first + 1);
+            }
+            else
+            {
+                addPart(pieces, body.data() + range.first, range.last - range.first + 1);
+            }
+        }
+        addPart(pieces, response.trailer);
     }
 
-    return returnCode;
+    off_t length = 0;
+    for (size_t i = first; i < pieces.size(); i++)
+    {
+        length += pieces[i].length;
+    }
+    return length;
 }
 
-void sendLine(int socketFD, string stringToSend)
-{   
-    //Converting the string to a char array that is 2 bytes longer than the string
-    char buffer[stringToSend.size() + 2];
+//**************************************************************************************
+//* skipPieces()
+//* - Moves past bytes that have been sent, which may end partway through a piece.
+//**************************************************************************************
+static void skipPieces(vector<OutputPiece> &pieces, size_t &next, size_t bytes)
+{
+    while (bytes > 0 && next < pieces.size())
+    {
+        OutputPiece &piece = pieces[next];
+        if (bytes >= piece.length)
+        {
+            bytes -= piece.length;
+            next++;
+            continue;
+        }
+        if (piece.data != NULL)
+        {
+            piece.data += bytes;
+        }
+        else
+        {
+            piece.offset += bytes;
+        }
+        piece.length -= bytes;
+        bytes = 0;
+    }
+}
 
-    //Copy the string content to the buffer
-    strcpy(buffer, stringToSend.c_str());
+enum FlushResult
+{
+    FLUSH_DONE,
+    FLUSH_BLOCKED,
+    FLUSH_FAILED
+};
 
-    //Replace the last two bytes of the array with <CR> and <LF>
-    buffer[stringToSend.size()] = '\r';
-    buffer[stringToSend.size() + 1] = '\n';
+//**************************************************************************************
+//* sendPieces()
+//* - Sends as much of the pieces as the socket will take without blocking. Bytes in
+//*   memory are gathered into one sendmsg() and file bodies go out with sendfile(),
+//*   which copies them from the page cache without passing through this process.
+//* - Everything but the last piece is sent with MSG_MORE, so a header shares a
+//*   segment with the start of the file after it instead of going out alone.
+//* - sent is set to the number of bytes that went out.
+//**************************************************************************************
+static FlushResult sendPieces(int socketFD, vector<OutputPiece> &pieces, off_t &sent)
+{
+    sent = 0;
+    size_t next = 0;
+    struct iovec parts[IOV_MAX];
+    while (next < pieces.size())
+    {
+        ssize_t bytesSent;
+        const char *call;
+        if (pieces[next].data != NULL)
+        {
+            int count = 0;
+            for (size_t i = next; i < pieces.size() && pieces[i].data != NULL && count < IOV_MAX; i++)
+            {
+                parts[count].iov_base = (void *)pieces[i].data;
+                parts[count].iov_len = pieces[i].length;
+                count++;
+            }
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = parts;
+            message.msg_iovlen = count;
+            int flags = next + count < pieces.size() ? MSG_MORE : 0;
+            bytesSent = sendmsg(socketFD, &message, flags);
+            call = "sendmsg";
+        }
+        else
+        {
+            OutputPiece &piece = pieces[next];
+            off_t offset = piece.offset;
+            bytesSent = sendfile(socketFD, piece.fileFD, &offset, piece.length);
+            call = "sendfile";
+            if (bytesSent == 0)
+            {
+                //The file got shorter after fstat(); the client can't be given what was promised
+                cout << "File ended early" << endl;
+                return FLUSH_FAILED;
+            }
+        }
 
-    //Use write to send the modified array
-    ssize_t bytesSent = write(socketFD, buffer, sizeof(buffer));
+        if (bytesSent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesSent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return FLUSH_BLOCKED;
+        }
+        if (bytesSent == -1)
+        {
+            perror(call);
+            return FLUSH_FAILED;
+        }
+        sent += bytesSent;
+        skipPieces(pieces, next, bytesSent);
+    }
+    return FLUSH_DONE;
+}
 
-    if (bytesSent == -1) {
-        perror("write");
-    } else {
-        DEBUG << ENDL;
-        DEBUG << "Sent: " << stringToSend << ENDL;
+//**************************************************************************************
+//* flushOutput()
+//* - Sends as much of the queued responses as the client will take without blocking,
+//*   and drops the ones that are all sent.
+//* - Returns FLUSH_BLOCKED if the socket buffer filled first. The rest stays queued,
+//*   with how far the first response got, to be sent once the socket drains.
+//**************************************************************************************
+static FlushResult flushOutput(int socketFD, OutputQueue &output)
+{
+    if (output.responses.empty())
+    {
+        return FLUSH_DONE;
+    }
+    vector<OutputPiece> pieces;
+    vector<off_t> lengths;
+    for (const Response &response : output.responses)
+    {
+        lengths.push_back(responsePieces(response, pieces));
+    }
+    size_t next = 0;
+    skipPieces(pieces, next, output.sent);
+    pieces.erase(pieces.begin(), pieces.begin() + next);
+
+    off_t sent = 0;
+    FlushResult result = sendPieces(socketFD, pieces, sent);
+    DEBUG << "Sent " << sent << " bytes of " << output.responses.size() << " responses" << ENDL;
+
+    //Whole responses that went out are done with
+    sent += output.sent;
+    size_t done = 0;
+    while (done < lengths.size() && sent >= lengths[done])
+    {
+        sent -= lengths[done];
+        done++;
     }
+    output.responses.erase(output.responses.begin(), output.responses.begin() + done);
+    output.sent = sent;
+    return result;
 }
 
-void send404(int socketFD)
+//**************************************************************************************
+//* errorResponse()
+//* - A 404 or 400 response.
+//**************************************************************************************
+static Response errorResponse(int code, bool keepAlive, bool headOnly)
 {
-    //HTTP response with error code 404 and content-type header
-    string response = "HTTP/1.0 404 Not Found\r\n";
-    response += "Content-Type: text/html\r\n";
-    //Blank line to terminate the header
-    response += "\r\n"; 
-
-    //HTML body with a friendly error message
-    response += "<html><body><h1>404 Not Found</h1>";
-    response += "<p>The requested file was not found on this server.</p>";
-    response += "</body></html>";
-
-    //Send the response using the sendLine function
-    sendLine(socketFD, response);
+    Response response;
+    response.headOnly = headOnly;
+    response.keepAlive = keepAlive;
+    if (code == 404)
+    {
+        //HTML body with a friendly error message
+        response.body = "<html><body><h1>404 Not Found</h1>";
+        response.body += "<p>The requested file was not found on this server.</p>";
+        response.body += "</body></html>";
+        response.header = "HTTP/1.1 404 Not Found\r\n";
+        response.header += "Content-Type: text/html\r\n";
+    }
+    else
+    {
+        response.header = "HTTP/1.1 400 Bad Request\r\n";
+    }
+    response.header += "Content-Length: " + to_string(response.body.size()) + "\r\n";
+    return response;
 }
 
-void send400(int socketFD)
+//**************************************************************************************
+//* statsResponse()
+//* - The answer to a request for /cache-stats: the response cache's counters.
+//**************************************************************************************
+static Response statsResponse(bool keepAlive, bool headOnly)
 {
-    //HTTP response with error code 400
-    string response = "HTTP/1.0 400 Bad Request\r\n";
-    //Blank line to indicate the end of the response
-    response += "\r\n"; 
+    Response response;
+    response.headOnly = headOnly;
+    response.keepAlive = keepAlive;
+    response.body = cacheStats(responseCache);
+    response.header = "HTTP/1.1 200 OK\r\n";
+    response.header += "Content-Type: text/plain\r\n";
+    response.header += "Content-Length: " + to_string(response.body.size()) + "\r\n";
+    return response;
+}
 
-    //Send the response using the sendLine function
-    sendLine(socketFD, response);
+//**************************************************************************************
+//* isNotModified()
+//* - True if a conditional request's copy is still current, so a 304 will do. An
+//*   If-None-Match header, when there is one, decides it on its own.
+//**************************************************************************************
+static bool isNotModified(const HttpRequest &request, const Validators &validators)
+{
+    string_view ifNoneMatch = findHeader(request, "If-None-Match");
+    if (!ifNoneMatch.empty())
+    {
+        return etagMatches(ifNoneMatch, validators.etag);
+    }
+    time_t since;
+    string_view ifModifiedSince = findHeader(request, "If-Modified-Since");
+    return !ifModifiedSince.empty() && parseHttpDate(ifModifiedSince, since) && validators.lastModified <= since;
 }
 
-void send200(int socketFD, string filename)
+//**************************************************************************************
+//* requestedRanges()
+//* - The ranges a GET asks for. An If-Range that no longer matches the file, by strong
+//*   ETag or exact date, means the whole file is wanted instead.
+//**************************************************************************************
+static RangeResult requestedRanges(const HttpRequest &request, const Validators &validators, off_t size,
+                                   RangeSet &ranges)
 {
-    //Use stat() function to get file size and check if the file exists
-    struct stat fileStat;
-    if (stat(filename.c_str(), &fileStat) == -1)
+    string_view range = findHeader(request, "Range");
+    if (request.method != "GET" || range.empty())
     {
-        cout << "stat failed" << endl;
-        //If stat fails, send a 404 response and exit the function
-        send404(socketFD);
+        return RANGE_NONE;
+    }
+    string_view ifRange = findHeader(request, "If-Range");
+    if (!ifRange.empty())
+    {
+        time_t date;
+        bool current = ifRange.front() == '"' ? ifRange == validators.etag
+                                              : parseHttpDate(ifRange, date) && date == validators.lastModified;
+        if (!current)
+        {
+            return RANGE_NONE;
+        }
+    }
+    return parseRange(range, size, ranges);
+}
+
+//**************************************************************************************
+//* notSatisfiableResponse()
+//* - A 416 for a Range that asks for nothing inside the file.
+//**************************************************************************************
+static Response notSatisfiableResponse(off_t size, bool keepAlive)
+{
+    Response response;
+    response.header = notSatisfiableHeader(size);
+    response.keepAlive = keepAlive;
+    return response;
+}
+
+//**************************************************************************************
+//* queueBundled()
+//* - Answers a GET or HEAD for a file in the bundle, as a 200, 304, 206 or 416 like a
+//*   cached file. The headers were built by the packer. A body of up to
+//*   kInlineBodySize is sent as a view of the mapping; a bigger one with sendfile()
+//*   from its offset in the bundle.
+//**************************************************************************************
+static void queueBundled(vector<Response> &queue, const BundledFile &file, const HttpRequest &request,
+                         bool keepAlive)
+{
+    DEBUG << "Serving " << file.name << " from the bundle" << ENDL;
+    Response response;
+    response.bundled = &file;
+    response.notModified = isNotModified(request, file.validators);
+    response.headOnly = request.method == "HEAD";
+    response.keepAlive = keepAlive;
+
+    RangeSet ranges;
+    off_t size = file.body.size();
+    RangeResult range = response.notModified ? RANGE_NONE : requestedRanges(request, file.validators, size, ranges);
+    if (range == RANGE_NOT_SATISFIABLE)
+    {
+        queue.push_back(notSatisfiableResponse(size, keepAlive));
         return;
     }
+    if (range == RANGE_SATISFIABLE)
+    {
+        PartialResponse partial = partialResponse(string(file.name), size, file.validators, ranges, false);
+        response.header = move(partial.header);
+        response.partHeaders = move(partial.partHeaders);
+        response.trailer = move(partial.trailer);
+        response.ranges = ranges;
+    }
+    if (file.body.size() > kInlineBodySize)
+    {
+        response.fileFD = bundle.fd;
+        response.fileOffset = file.bodyOffset;
+        response.fileLength = size;
+    }
+    queue.push_back(move(response));
+}
 
-    //Determine content type based on file extension
-    string contentType = "text/html";
-    size_t dotPosition = filename.find_last_of(".");
-    if (dotPosition != string::npos)
+//**************************************************************************************
+//* queueFile()
+//* - Answers a GET or HEAD for a file. A cached response is gzip encoded if the client
+//*   accepts that and there is a gzip variant, a 304 if the client's copy is current,
+//*   or a 206 or 416 for a Range. Ranges are always of the unencoded file.
+//* - A file the cache can't hold is kept open and its body sent from disk with
+//*   sendfile() when its turn comes.
+//**************************************************************************************
+static void queueFile(vector<Response> &queue, const Route &route, const HttpRequest &request, bool keepAlive)
+{
+    if (route.bundled)
+    {
+        queueBundled(queue, *route.bundled, request, keepAlive);
+        return;
+    }
+    const string &fileName = route.fileName;
+    bool headOnly = request.method == "HEAD";
+    RangeSet ranges;
+    shared_ptr<const CachedResponse> cached = lookupResponse(responseCache, fileName);
+    if (cached)
     {
-        string extension = filename.substr(dotPosition + 1);
-        if (extension == "jpg" || extension == "jpeg")
+        DEBUG << "Serving " << fileName << " from the cache" << ENDL;
+        Response response;
+        response.cached = cached;
+        response.gzip = !cached->gzip.body.empty() && acceptsEncoding(findHeader(request, "Accept-Encoding"), "gzip");
+        const ResponseVariant &variant = response.gzip ? cached->gzip : cached->identity;
+        response.notModified = isNotModified(request, variant.validators);
+        response.headOnly = headOnly;
+        response.keepAlive = keepAlive;
+
+        const ResponseVariant &identity = cached->identity;
+        RangeResult range = response.notModified
+                                ? RANGE_NONE
+                                : requestedRanges(request, identity.validators, identity.body.size(), ranges);
+        if (range == RANGE_NOT_SATISFIABLE)
         {
-            contentType = "image/jpeg";
+            queue.push_back(notSatisfiableResponse(identity.body.size(), keepAlive));
+            return;
+        }
+        if (range == RANGE_SATISFIABLE)
+        {
+            PartialResponse partial = partialResponse(fileName, identity.body.size(), identity.validators, ranges);
+            response.gzip = false;
+            response.header = move(partial.header);
+            response.partHeaders = move(partial.partHeaders);
+            response.trailer = move(partial.trailer);
+            response.ranges = ranges;
         }
+        queue.push_back(move(response));
+        return;
     }
 
-    //Construct the HTTP response header with status line, content-type, and content-length
-    string response = "HTTP/1.0 200 OK\r\n";
-    response += "Content-Type: " + contentType + "\r\n";
-    response += "Content-Length: " + to_string(fileStat.st_size) + "\r\n";
+    //Open the file and use fstat() to get its size, so the size is of the file sent
+    int fileFD = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat fileStat;
+    if (fileFD == -1 || fstat(fileFD, &fileStat) == -1)
+    {
+        cout << "stat failed" << endl;
+        //If the file can't be opened, answer with a 404
+        if (fileFD != -1)
+        {
+            close(fileFD);
+        }
+        queue.push_back(errorResponse(404, keepAlive, headOnly));
+        return;
+    }
+    shared_ptr<const OpenFile> openFile = make_shared<const OpenFile>(fileFD);
+
+    Validators validators = fileValidators(fileStat);
+    Response response;
+    response.notModified = isNotModified(request, validators);
+    response.headOnly = headOnly;
+    response.keepAlive = keepAlive;
+    RangeResult range = response.notModified ? RANGE_NONE
+                                             : requestedRanges(request, validators, fileStat.st_size, ranges);
+    if (range == RANGE_NOT_SATISFIABLE)
+    {
+        queue.push_back(notSatisfiableResponse(fileStat.st_size, keepAlive));
+        return;
+    }
+    if (range == RANGE_SATISFIABLE)
+    {
+        PartialResponse partial = partialResponse(fileName, fileStat.st_size, validators, ranges);
+        response.header = move(partial.header);
+        response.partHeaders = move(partial.partHeaders);
+        response.trailer = move(partial.trailer);
+        response.ranges = ranges;
+    }
+    else
+    {
+        response.header = response.notModified ? notModifiedHeader(fileName, validators)
+                                               : responseHeader(fileName, fileStat.st_size, validators);
+    }
+    //A HEAD or a 304 has no body, so the file can be closed straight away
+    if (!response.headOnly && !response.notModified)
+    {
+        response.openFile = openFile;
+        response.fileFD = fileFD;
+        response.fileLength = fileStat.st_size;
+    }
+    queue.push_back(move(response));
+}
 
-    //Send the response header using the sendLine function
-    sendLine(socketFD, response);
+enum ReadResult
+{
+    READ_DATA,
+    READ_BLOCKED,
+    READ_CLOSED
+};
 
-    //Send the file content
-    ifstream fileStream(filename, ios::binary);
+//**************************************************************************************
+//* readMore()
+//* - Reads whatever the client has sent next into the parser's buffer, making room
+//*   first if the buffer is full of earlier requests.
+//* - Returns READ_BLOCKED if there is nothing to read yet, and READ_CLOSED if the
+//*   client closed the connection or it failed.
+//**************************************************************************************
+static ReadResult readMore(int socketFD, RequestParser &parser)
+{
+    if (parser.length == sizeof(parser.buffer))
+    {
+        compactRequestBuffer(parser);
+    }
+    while (true)
+    {
+        ssize_t bytesRead = recv(socketFD, parser.buffer + parser.length, sizeof(parser.buffer) - parser.length, 0);
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return READ_BLOCKED;
+        }
+        if (bytesRead == -1)
+        {
+            perror("recv");
+            return READ_CLOSED;
+        }
+        if (bytesRead == 0)
+        {
+            DEBUG << "Client closed the connection" << ENDL;
+            return READ_CLOSED;
+        }
+        parser.length += bytesRead;
+        return READ_DATA;
+    }
+}
 
-    //Allocate 10 bytes of memory
-    char *buffer = new char[10]; 
+//**************************************************************************************
+//* serveConnection()
+//* - First sends whatever an earlier call left queued. Then answers every request that
+//*   can be read from the connection without blocking. Pipelined requests are parsed
+//*   out of the buffer one after another and answered in order. Their responses are
+//*   queued and sent together before the next read.
+//* - Returns SERVE_WRITE if the client's socket buffer filled up, leaving the rest of
+//*   the output and any requests not yet answered for when it drains; SERVE_CLOSE once
+//*   the client has closed the connection or asked for it to be closed; and
+//*   SERVE_READ to wait for more requests.
+//**************************************************************************************
+ServeResult serveConnection(Connection &connection)
+{
+    int sockFd = connection.fd;
+    RequestParser &parser = connection.parser;
+    if (connection.output == NULL)
+    {
+        connection.output = new OutputQueue;
+    }
+    OutputQueue &output = *connection.output;
+    vector<Response> &queue = output.responses;
 
-    //Feading while the filestream is still good
-    while (fileStream.good())
+    while (true)
     {
-        //Feading 10 bytes of data
-        fileStream.read(buffer, 10);
+        //Nothing more is answered while earlier responses are waiting to go out
+        FlushResult flushed = flushOutput(sockFd, output);
+        if (flushed == FLUSH_BLOCKED)
+        {
+            return SERVE_WRITE;
+        }
+        if (flushed == FLUSH_FAILED || output.closing)
+        {
+            return SERVE_CLOSE;
+        }
 
-        //Clear out the memory with bzero or memset
-        memset(buffer + fileStream.gcount(), 0, 10 - fileStream.gcount());
+        while (queue.size() < kMaxQueuedResponses && !output.closing)
+        {
+            HttpRequest request;
+            ParseResult result = parseRequest(parser, request);
+            if (result == PARSE_INCOMPLETE)
+            {
+                break;
+            }
+            if (result == PARSE_ERROR)
+            {
+                //There's no telling where the next request would start, so the connection ends
+                queue.push_back(errorResponse(400, false, false));
+                output.closing = true;
+                break;
+            }
+
+            bool keepAlive = keepAliveTimeout > 0 && wantsKeepAlive(request);
+            bool headOnly = request.method == "HEAD";
+            const Route *route = NULL;
+            switch (checkRequest(request, route))
+            {
+            case 200:
+                if (route == &kStatsRoute)
+                {
+                    queue.push_back(statsResponse(keepAlive, headOnly));
+                    break;
+                }
+                queueFile(queue, *route, request, keepAlive);
+                break;
+            case 404:
+                queue.push_back(errorResponse(404, keepAlive, headOnly));
+                break;
+            default:
+                queue.push_back(errorResponse(400, keepAlive, headOnly));
+                break;
+            }
+            nextRequest(parser);
+            output.closing = !keepAlive;
+        }
+        if (!queue.empty())
+        {
+            continue;
+        }
 
-        //Write the bytes read from the file to the socket
-        ssize_t bytesSent = write(socketFD, buffer, 10);
-        if (bytesSent == -1)
+        //Everything asked for so far is answered before reading again
+        ReadResult read = readMore(sockFd, parser);
+        if (read == READ_BLOCKED)
         {
-            perror("write");
-            delete[] buffer;
-            return;
+            return SERVE_READ;
+        }
+        if (read == READ_CLOSED)
+        {
+            return SERVE_CLOSE;
         }
     }
+}
 
-    //Clean up and close the file
-    fileStream.close();
-    delete[] buffer;
+//**************************************************************************************
+//* usage()
+//* - Prints the command line options and exits.
+//**************************************************************************************
+static void usage(const char *program)
+{
+    cout << "usage: " << program << " [-v] [-c cache_kilobytes] [-k idle_seconds] [-b backlog]"
+         << " [-r reactors] [-w workers] [-d document_root] [-B bundle]" << endl;
+    exit(-1);
 }
+
 //**************************************************************************************
-//* processConnection()
-//* - Handles reading the line from the network and sending it back to the client.
-//* - Returns true if the client sends "QUIT" command, false if the client sends "CLOSE".
+//* numberArgument()
+//* - An option's value as a number no smaller than minimum, or the usage message.
 //**************************************************************************************
-int processConnection(int sockFd)
+static int numberArgument(const char *program, const char *argument, int minimum)
 {
-    string fileName = "";
-    int returnCode = readRequest(sockFd, fileName);
-
-    switch (returnCode)
-    {
-    case 400:
-        send400(sockFd);
-        break;
-    case 404:
-        send404(sockFd);
-        break;
-    case 200:
-        send200(sockFd, fileName);
-        break;
-    default:
-        break;
+    char *end = NULL;
+    long value = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || value < minimum || value > INT_MAX)
+    {
+        usage(program);
     }
-    return 0;
+    return value;
 }
 
 //**************************************************************************************
 //* main()
-//* - Sets up the sockets and accepts new connection until processConnection() returns 1
+//* - Reads the options, builds the route table from the document root or the bundle
+//*   and sets up the response cache and the listening socket. The server works from
+//*   inside the document root, so the names it opens and watches are all relative
+//*   to it.
+//* - Then hands the socket to runServer(), whose reactors accept connections and whose
+//*   worker pool answers them. It doesn't return.
 //**************************************************************************************
 int main(int argc, char *argv[])
 {
@@ -212,20 +841,87 @@ int main(int argc, char *argv[])
     //* Process the command line arguments
     //********************************************************************
     int opt = 0;
-    while ((opt = getopt(argc, argv, "v")) != -1)
+    size_t cacheSize = kDefaultCacheSize;
+    int listenQueueLength = kDefaultListenQueueLength;
+    int reactorCount = 1;
+    int workerCount = thread::hardware_concurrency();
+    const char *bundlePath = NULL;
+    const char *documentRoot = kDefaultDocumentRoot;
+    if (workerCount < 1)
+    {
+        workerCount = 1;
+    }
+    while ((opt = getopt(argc, argv, "vc:k:b:r:w:d:B:")) != -1)
     {
         switch (opt)
         {
         case 'v':
             VERBOSE = true;
             break;
+        case 'c':
+            //Cache size in kilobytes, 0 to turn the cache off
+            cacheSize = numberArgument(argv[0], optarg, 0) * 1024;
+            break;
+        case 'k':
+            //Keep-alive idle timeout in seconds, 0 to close after every response
+            keepAliveTimeout = numberArgument(argv[0], optarg, 0);
+            break;
+        case 'b':
+            listenQueueLength = numberArgument(argv[0], optarg, 1);
+            break;
+        case 'r':
+            reactorCount = numberArgument(argv[0], optarg, 1);
+            break;
+        case 'w':
+            workerCount = numberArgument(argv[0], optarg, 1);
+            break;
+        case 'd':
+            documentRoot = optarg;
+            break;
+        case 'B':
+            //Serve the files packed into a bundle instead of the directory's
+            bundlePath = optarg;
+            break;
         case ':':
         case '?':
         default:
-            cout << "usage: " << argv[0] << " -v" << endl;
+            usage(argv[0]);
+        }
+    }
+    size_t routeCount = 0;
+    if (bundlePath != NULL)
+    {
+        if (!openBundle(bundle, bundlePath))
+        {
+            exit(-1);
+        }
+        vector<Route> routes;
+        for (const BundledFile &file : bundle.files)
+        {
+            //The bundle's names are held to the same rules as the directory's
+            if (contentType(file.name) != NULL && requestPath(string("/") + string(file.name)) == file.name)
+            {
+                routes.push_back(Route{string(file.name), contentType(file.name), &file});
+            }
+        }
+        routeCount = buildRouteTable(routeTable, routes);
+        //The bundle is already in memory, so there is nothing to cache
+        cacheSize = 0;
+    }
+    else
+    {
+        if (chdir(documentRoot) == -1)
+        {
+            perror(documentRoot);
             exit(-1);
         }
+        routeCount = buildRouteTable(routeTable, ".");
     }
+    DEBUG << "Serving " << routeCount << " files" << ENDL;
+    initResponseCache(responseCache, cacheSize);
+
+    //A client that goes away mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     //*******************************************************************
     //* Creating the inital socket is the same as in a client.
@@ -280,7 +976,6 @@ int main(int argc, char *argv[])
     //* needed to being accepting connections.  This creates a queue for
     //* connections and starts the kernel listening for connections.
     //********************************************************************
-    int listenQueueLength = 1;
     //Making sure that socket is set to listening state
     if (listen(listenFd, listenQueueLength) == -1)
     {
@@ -290,40 +985,16 @@ int main(int argc, char *argv[])
     DEBUG << "Calling listen(" << listenFd << "," << listenQueueLength << ")" << ENDL;
 
     //********************************************************************
-    //* The accept call will sleep, waiting for a connection.  When
-    //* a connection request comes in the accept() call creates a NEW
-    //* socket with a new fd that will be used for the communication.
+    //* The reactors accept connections as they come in and hand the
+    //* requests on them to the workers. The listening socket is
+    //* non-blocking so a reactor can accept until none are left.
     //********************************************************************
-    bool quitProgram = false;
-    while (!quitProgram)
+    if (fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK) == -1)
     {
-        int connFd = accept(listenFd, NULL, NULL);
-        if (connFd == -1)
-        {
-            perror("accept");
-            continue;
-        }
-
-        DEBUG << "Calling accept(" << listenFd << "NULL,NULL)." << ENDL;
-
-        if (connFd == -1)
-        {
-            perror("accept");
-            continue;
-        }
-
-        DEBUG << "We have received a connection on " << connFd << ENDL;
-
-        int tempVal = processConnection(connFd);
-        if (tempVal == 0)
-        {
-            quitProgram = false;
-        }
-        else
-        {
-            quitProgram = true;
-        } 
+        perror("fcntl");
+        exit(-1);
     }
+    runServer(listenFd, responseCache.inotifyFD, reactorCount, workerCount);
 
     //Close the listening socket
     close(listenFd);